@@ -0,0 +1,157 @@
+/// @file batch_bench.cpp
+///
+/// Moves a given amount of data over loopback as WINDOW_SIZE bursts of data
+/// packets, each answered by one ACK per packet, first with a sendto() or
+/// recvfrom() per datagram and then with SendBatch/RecvBatch. Prints the
+/// system calls per MB and the time each approach takes.
+///
+/// Usage: batch_bench [megabytes] [payload-bytes]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../netio.h"
+#include "../util.h"
+
+static int open_socket(struct sockaddr_in& addr)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == -1)
+    {
+        perror("Error: Could not create socket");
+        exit(EXIT_FAILURE);
+    }
+
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (char*)&buffer_size, sizeof(buffer_size));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, (char*)&buffer_size, sizeof(buffer_size));
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t slen = sizeof(addr);
+    if (bind(sockfd, (struct sockaddr*)&addr, slen) == -1
+        || getsockname(sockfd, (struct sockaddr*)&addr, &slen) == -1)
+    {
+        perror("Error: Could not bind socket");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+static double seconds_since(const timespec& start)
+{
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Reads until count datagrams have arrived, one recvfrom() each
+static unsigned long drain_single(int sockfd, Packet& packet, int count)
+{
+    unsigned long calls = 0;
+    while (count > 0)
+    {
+        calls++;
+        if (recvfrom(sockfd, packet.buffer, MAX_PACKET_SIZE, 0, NULL, NULL) > 0)
+            count--;
+    }
+    return calls;
+}
+
+static unsigned long drain_batch(int sockfd, RecvBatch& batch, int count)
+{
+    unsigned long calls = 0;
+    while (count > 0)
+    {
+        calls++;
+        int received = batch.receive(sockfd, true);
+        if (received > 0)
+            count -= received;
+    }
+    return calls;
+}
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 0) : 64;
+    size_t payload = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_PAYLOAD_SIZE;
+    if (payload < MIN_PAYLOAD_SIZE || payload > MAX_PAYLOAD_SIZE)
+    {
+        fprintf(stderr, "Error: payload must be between %d and %d bytes\n", MIN_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in sender_addr;
+    struct sockaddr_in receiver_addr;
+    int sender = open_socket(sender_addr);
+    int receiver = open_socket(receiver_addr);
+
+    size_t rounds = (megabytes * 1024 * 1024) / (payload * WINDOW_SIZE);
+    double mb = (double)(rounds * WINDOW_SIZE * payload) / (1024 * 1024);
+
+    static Packet data;
+    static Packet ack;
+    memset(data.data(), 'x', payload);
+    data.seal(payload, 0, TRN);
+    ack.seal(0, 0, ACK);
+
+    // One system call per datagram, as the protocol used to do
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long single_calls = 0;
+    static Packet scratch;
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (int i = 0; i < WINDOW_SIZE; ++i, ++single_calls)
+            sendto(sender, data.buffer, data.length(), 0, (struct sockaddr*)&receiver_addr, sizeof(receiver_addr));
+        single_calls += drain_single(receiver, scratch, WINDOW_SIZE);
+        for (int i = 0; i < WINDOW_SIZE; ++i, ++single_calls)
+            sendto(receiver, ack.buffer, ack.length(), 0, (struct sockaddr*)&sender_addr, sizeof(sender_addr));
+        single_calls += drain_single(sender, scratch, WINDOW_SIZE);
+    }
+    double single_time = seconds_since(start);
+
+    // The same exchange through the batching layer
+    SendBatch data_out(sender);
+    SendBatch ack_out(receiver);
+    RecvBatch data_in;
+    RecvBatch ack_in;
+    unsigned long batch_calls = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (int i = 0; i < WINDOW_SIZE; ++i)
+        {
+            data_out.next().copy_from(data);
+            data_out.push(receiver_addr);
+        }
+        data_out.flush();
+        batch_calls += drain_batch(receiver, data_in, WINDOW_SIZE);
+        for (int i = 0; i < WINDOW_SIZE; ++i)
+        {
+            ack_out.next().copy_from(ack);
+            ack_out.push(sender_addr);
+        }
+        ack_out.flush();
+        batch_calls += drain_batch(sender, ack_in, WINDOW_SIZE);
+    }
+    double batch_time = seconds_since(start);
+    batch_calls += data_out.calls() + ack_out.calls();
+
+    printf("payload %zu bytes, window %d, %.1f MB\n", payload, WINDOW_SIZE, mb);
+    printf("%-10s %14s %12s %10s\n", "mode", "syscalls/MB", "seconds", "MB/s");
+    printf("%-10s %14.1f %12.3f %10.1f\n", "single", single_calls / mb, single_time, mb / single_time);
+    printf("%-10s %14.1f %12.3f %10.1f\n", "batched", batch_calls / mb, batch_time, mb / batch_time);
+
+    close(sender);
+    close(receiver);
+    return 0;
+}
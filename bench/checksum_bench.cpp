@@ -0,0 +1,87 @@
+/// @file checksum_bench.cpp
+///
+/// Runs every checksum variant this CPU supports over the same buffer of
+/// packet sized blocks, checks that the variants of each algorithm agree, and
+/// prints the throughput of each. byte-sum/scalar is the checksum the
+/// protocol has always used.
+///
+/// Usage: checksum_bench [megabytes] [block-bytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "../checksum.h"
+#include "../util.h"
+
+static double seconds_since(const timespec& start)
+{
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+    size_t block = argc > 2 ? strtoul(argv[2], NULL, 0) : HEADER_SIZE + DEFAULT_PAYLOAD_SIZE;
+    if (block == 0 || block > MAX_PACKET_SIZE)
+    {
+        fprintf(stderr, "Error: block must be between 1 and %d bytes\n", MAX_PACKET_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    // A few MB of random data, walked over repeatedly so the numbers reflect
+    // the checksum rather than memory bandwidth
+    size_t blocks = (4 * 1024 * 1024) / block + 1;
+    std::vector<char> buffer(blocks * block);
+    srand(1);
+    for (size_t i = 0; i < buffer.size(); ++i)
+        buffer[i] = (char)rand();
+    size_t passes = (megabytes * 1024 * 1024) / block;
+
+    size_t count;
+    const ChecksumVariant* variants = checksum_variants(count);
+
+    printf("block %zu bytes, %zu MB per variant\n", block, passes * block / (1024 * 1024));
+    printf("%-18s %10s %10s %10s\n", "variant", "seconds", "GB/s", "result");
+
+    uint32_t reference[3] = { 0, 0, 0 };
+    bool seen[3] = { false, false, false };
+    for (size_t v = 0; v < count; ++v)
+    {
+        if (!variants[v].supported())
+        {
+            printf("%-18s %10s\n", variants[v].name, "n/a");
+            continue;
+        }
+
+        uint32_t combined = 0;
+        timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < passes; ++i)
+            combined ^= variants[v].function(&buffer[(i % blocks) * block], block);
+        double seconds = seconds_since(start);
+
+        // Variants of the same algorithm must produce the same checksums
+        uint8_t algorithm = variants[v].algorithm;
+        if (!seen[algorithm])
+        {
+            reference[algorithm] = combined;
+            seen[algorithm] = true;
+        }
+        else if (combined != reference[algorithm])
+        {
+            fprintf(stderr, "Error: %s disagrees with the other %s variants\n",
+                variants[v].name, checksum_name(algorithm));
+            exit(EXIT_FAILURE);
+        }
+
+        double gb = (double)passes * block / 1e9;
+        printf("%-18s %10.3f %10.2f %10x\n", variants[v].name, seconds, gb / seconds, combined);
+    }
+
+    return 0;
+}
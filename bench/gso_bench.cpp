@@ -0,0 +1,163 @@
+/// @file gso_bench.cpp
+///
+/// Moves a given amount of data over loopback in bursts of BATCH_SIZE data
+/// packets through SendBatch/RecvBatch, first as plain batches, then with
+/// segmentation offload on the sender, then with receive offload on the
+/// receiver as well. Prints the system calls and the CPU time per packet
+/// each mode costs.
+///
+/// Usage: gso_bench [megabytes] [payload-bytes]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../netio.h"
+#include "../util.h"
+
+#define MODE_PLAIN 0
+#define MODE_GSO 1
+#define MODE_GSO_GRO 2
+
+static int open_socket(struct sockaddr_in& addr)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == -1)
+    {
+        perror("Error: Could not create socket");
+        exit(EXIT_FAILURE);
+    }
+
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (char*)&buffer_size, sizeof(buffer_size));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, (char*)&buffer_size, sizeof(buffer_size));
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t slen = sizeof(addr);
+    if (bind(sockfd, (struct sockaddr*)&addr, slen) == -1
+        || getsockname(sockfd, (struct sockaddr*)&addr, &slen) == -1)
+    {
+        perror("Error: Could not bind socket");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static double seconds_since(const timespec& start)
+{
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+struct Result
+{
+    const char* name;
+    unsigned long packets;
+    unsigned long calls;
+    double cpu;
+    double wall;
+};
+
+// Sends rounds bursts of the packet and reads each burst back. Datagrams the
+// receiver's queue drops are not resent; the receive side just gives up on a
+// burst once the socket has been quiet for a while.
+static bool run(int mode, Packet& data, size_t rounds, Result& result)
+{
+    struct sockaddr_in sender_addr;
+    struct sockaddr_in receiver_addr;
+    int sender = open_socket(sender_addr);
+    int receiver = open_socket(receiver_addr);
+
+    SendBatch out(sender);
+    RecvBatch in;
+    if (mode != MODE_PLAIN && !out.enable_gso())
+        return false;
+    if (mode == MODE_GSO_GRO && !RecvBatch::enable_gro(receiver))
+        return false;
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+
+    result.packets = 0;
+    result.calls = 0;
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double cpu_start = cpu_seconds();
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        // Each packet goes out from where it is, as the server sends them
+        for (int i = 0; i < BATCH_SIZE; ++i)
+            out.push(receiver_addr, data.buffer, data.length());
+        out.flush();
+
+        int waiting = BATCH_SIZE;
+        while (waiting > 0)
+        {
+            int received = in.receive(receiver, true);
+            if (received <= 0)
+                break;
+            waiting -= received;
+            result.packets += received;
+        }
+    }
+    result.wall = seconds_since(start);
+    result.cpu = cpu_seconds() - cpu_start;
+    result.calls = out.calls() + in.calls();
+
+    close(sender);
+    close(receiver);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+    size_t payload = argc > 2 ? strtoul(argv[2], NULL, 0) : 1400;
+    if (payload < MIN_PAYLOAD_SIZE || payload > MAX_PAYLOAD_SIZE / 2)
+    {
+        fprintf(stderr, "Error: payload must be between %d and %d bytes\n", MIN_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE / 2);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t rounds = (megabytes * 1024 * 1024) / (payload * BATCH_SIZE);
+    static Packet data;
+    memset(data.data(), 'x', payload);
+    data.seal(payload, 0, TRN);
+
+    Result results[3];
+    const char* names[3] = { "batched", "gso", "gso+gro" };
+    printf("payload %zu bytes, bursts of %d, %zu bursts\n", payload, BATCH_SIZE, rounds);
+    printf("%-10s %12s %14s %14s %10s\n", "mode", "received", "syscalls/1k", "cpu ns/packet", "MB/s");
+    for (int mode = MODE_PLAIN; mode <= MODE_GSO_GRO; ++mode)
+    {
+        Result& result = results[mode];
+        result.name = names[mode];
+        if (!run(mode, data, rounds, result))
+        {
+            printf("%-10s %12s\n", result.name, "unsupported");
+            continue;
+        }
+        double mb = (double)result.packets * payload / (1024 * 1024);
+        printf("%-10s %12lu %14.1f %14.1f %10.1f\n", result.name, result.packets,
+            result.calls * 1000.0 / result.packets, result.cpu * 1e9 / result.packets, mb / result.wall);
+    }
+    return 0;
+}
@@ -0,0 +1,664 @@
+/// @file transfer_bench.cpp
+///
+/// Runs the real server and client against each other over loopback for a
+/// grid of file sizes, gremlin settings and client modes. Each cell of the
+/// grid is run several times, and the median of its completion time,
+/// goodput, retransmission ratio and the CPU time of both ends goes to a CSV
+/// file and is compared against a baseline CSV from an earlier run. A cell
+/// with a failed transfer, or whose median is slower or retransmits more
+/// than its baseline by more than the tolerance, is a regression and makes
+/// the exit status nonzero. A median only regresses if most of the runs do,
+/// so one run upset by the scheduler does not count.
+///
+/// A ranged fetch into a copy of a file the client already has must leave
+/// the rest of that copy as it was; a copy it damages is a regression too.
+///
+/// The server's retransmissions come from the "SENT:" line it logs for each
+/// finished session, found by the client port, which is different for each
+/// transfer. Its CPU time is read from /proc, as it serves every transfer of
+/// a gremlin setting.
+///
+/// Usage: transfer_bench [-r repo-dir] [-s max-MB] [-n runs] [-o results.csv]
+///                       [-b baseline.csv] [-t tolerance-%]
+///
+/// A new baseline is a results file copied over the old one.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../server.h"
+
+// Transfers take turns at this many client ports from the first
+#define BENCH_CLIENT_PORT 10053
+#define BENCH_CLIENT_PORTS 200
+#define BENCH_RUNS 3
+// How long the server gets to bind, and to log a finished session
+#define BENCH_START_MSEC 2000
+#define BENCH_FINISH_MSEC 3000
+// A transfer is given up on after this long plus a second per MB
+#define BENCH_TIMEOUT_SEC 60
+#define BENCH_TOLERANCE 20
+#define BENCH_SECONDS_SLACK 0.01
+#define BENCH_RATIO_SLACK 0.01
+
+// The server's <corrupt %> <loss %> <delay %> <delay-amount-ms> arguments
+struct Gremlin
+{
+    int corrupt;
+    int loss;
+    int delay;
+    int delay_ms;
+};
+
+static const size_t SIZES[] = { 1024, 1024 * 1024, 64 * 1024 * 1024, 1024 * 1024 * 1024 };
+static const Gremlin GREMLINS[] = {
+    { 0, 0, 0, 0 },
+    { 0, 1, 0, 0 },
+    { 0, 5, 0, 0 },
+    { 5, 0, 0, 0 },
+    { 0, 0, 5, 10 },
+    { 1, 1, 1, 10 },
+};
+static const char* MODES[] = { "gbn", "sr" };
+
+struct Result
+{
+    size_t size;
+    Gremlin gremlin;
+    std::string mode;
+    bool ok;
+    double seconds;
+    // MiB/s
+    double goodput;
+    double retransmit_ratio;
+    double client_cpu;
+    double server_cpu;
+};
+
+static pid_t running_client = 0;
+
+static void kill_client(int)
+{
+    if (running_client > 0)
+        kill(running_client, SIGKILL);
+}
+
+static double seconds_since(const timespec& start)
+{
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void sleep_msec(long msec)
+{
+    timespec pause;
+    pause.tv_sec = msec / 1000;
+    pause.tv_nsec = (msec % 1000) * 1000000;
+    nanosleep(&pause, NULL);
+}
+
+static std::string file_name(size_t size)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "bench_%zu.bin", size);
+    return name;
+}
+
+// Fills a file with bytes that do not compress, so that no codec or cache
+// flatters the numbers
+static void generate_file(const std::string& path, size_t size)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL)
+    {
+        perror("Error: Could not create test file");
+        exit(EXIT_FAILURE);
+    }
+    static uint64_t chunk[128 * 1024];
+    uint64_t state = 0x9E3779B97F4A7C15ull ^ size;
+    for (size_t written = 0; written < size;)
+    {
+        for (size_t i = 0; i < sizeof(chunk) / sizeof(chunk[0]); ++i)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            chunk[i] = state;
+        }
+        size_t length = size - written < sizeof(chunk) ? size - written : sizeof(chunk);
+        if (fwrite(chunk, 1, length, file) != length)
+        {
+            perror("Error: Could not write test file");
+            exit(EXIT_FAILURE);
+        }
+        written += length;
+    }
+    fclose(file);
+}
+
+static bool same_file(const std::string& a, const std::string& b)
+{
+    FILE* first = fopen(a.c_str(), "rb");
+    FILE* second = fopen(b.c_str(), "rb");
+    bool same = first != NULL && second != NULL;
+    static char left[1024 * 1024];
+    static char right[1024 * 1024];
+    while (same)
+    {
+        size_t length = fread(left, 1, sizeof(left), first);
+        same = fread(right, 1, sizeof(right), second) == length && memcmp(left, right, length) == 0;
+        if (length < sizeof(left))
+            break;
+    }
+    if (first != NULL)
+        fclose(first);
+    if (second != NULL)
+        fclose(second);
+    return same;
+}
+
+// Starts a program in dir with its output going to log, or thrown away if
+// log is empty
+static pid_t spawn(const std::string& dir, const std::string& log, std::vector<std::string>& args)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("Error: Could not fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid > 0)
+        return pid;
+
+    int out = open(log.empty() ? "/dev/null" : log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (chdir(dir.c_str()) == -1 || out == -1)
+        _exit(127);
+    dup2(out, STDOUT_FILENO);
+    dup2(out, STDERR_FILENO);
+    std::vector<char*> argv;
+    for (size_t i = 0; i < args.size(); ++i)
+        argv.push_back((char*)args[i].c_str());
+    argv.push_back(NULL);
+    execv(argv[0], &argv[0]);
+    _exit(127);
+}
+
+static std::string read_file(const std::string& path)
+{
+    std::string text;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+        return text;
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, length);
+    fclose(file);
+    return text;
+}
+
+// The CPU time a process has used so far, summed over its threads from
+// /proc, which counts it in nanoseconds rather than clock ticks
+static double process_cpu(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR* tasks = opendir(path);
+    if (tasks == NULL)
+        return 0;
+    unsigned long long total = 0;
+    struct dirent* entry;
+    while ((entry = readdir(tasks)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        std::string stat = read_file(std::string(path) + "/" + entry->d_name + "/schedstat");
+        unsigned long long nsec;
+        if (sscanf(stat.c_str(), "%llu", &nsec) == 1)
+            total += nsec;
+    }
+    closedir(tasks);
+    return total / 1e9;
+}
+
+// Waits for the server to log, past the first skip bytes, the session it
+// finished for the client on the given port and reads the packets it sent
+// for it. Returns false if it never does.
+static bool server_sent(const std::string& log, size_t skip, int port, unsigned long& sends,
+    unsigned long& resends)
+{
+    char client[64];
+    snprintf(client, sizeof(client), " to client 127.0.0.1:%d\n", port);
+    for (int waited = 0; waited < BENCH_FINISH_MSEC; waited += 10)
+    {
+        std::string text = read_file(log);
+        size_t at = text.find(client, skip);
+        if (at != std::string::npos)
+        {
+            size_t line = text.rfind("SENT: ", at);
+            return line != std::string::npos
+                && sscanf(text.c_str() + line, "SENT: %lu data packets, %lu", &sends, &resends) == 2;
+        }
+        sleep_msec(10);
+    }
+    return false;
+}
+
+static pid_t start_server(const std::string& server, const std::string& dir, const std::string& log,
+    const Gremlin& gremlin)
+{
+    char values[4][16];
+    snprintf(values[0], sizeof(values[0]), "%d", gremlin.corrupt);
+    snprintf(values[1], sizeof(values[1]), "%d", gremlin.loss);
+    snprintf(values[2], sizeof(values[2]), "%d", gremlin.delay);
+    snprintf(values[3], sizeof(values[3]), "%d", gremlin.delay_ms);
+    std::vector<std::string> args;
+    args.push_back(server);
+    for (int i = 0; i < 4; ++i)
+        args.push_back(values[i]);
+    // The last server's log must not pass for this one's
+    unlink(log.c_str());
+    pid_t pid = spawn(dir, log, args);
+
+    for (int waited = 0; waited < BENCH_START_MSEC; waited += 10)
+    {
+        if (read_file(log).find("listening") != std::string::npos)
+            return pid;
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            break;
+        sleep_msec(10);
+    }
+    fprintf(stderr, "Error: The server did not start; is port %d free?\n", SERVER_PORT);
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+static void stop_server(pid_t pid)
+{
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+// Fetches one file from the given client port and fills in result
+static void run_transfer(const std::string& client, const std::string& dir, const std::string& server_dir,
+    pid_t server, const std::string& server_log, int client_port, Result& result)
+{
+    std::string name = file_name(result.size);
+    char port[16];
+    char local_port[16];
+    snprintf(port, sizeof(port), "%d", SERVER_PORT);
+    snprintf(local_port, sizeof(local_port), "%d", client_port);
+    std::vector<std::string> args;
+    args.push_back(client);
+    args.push_back("-q");
+    args.push_back("-m");
+    args.push_back(result.mode);
+    args.push_back(local_port);
+    args.push_back("127.0.0.1");
+    args.push_back(port);
+    args.push_back("GET");
+    args.push_back(name);
+
+    size_t log_start = read_file(server_log).size();
+    double server_start = process_cpu(server);
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    running_client = spawn(dir, "", args);
+    alarm(BENCH_TIMEOUT_SEC + result.size / (1024 * 1024));
+
+    int status = 0;
+    struct rusage usage;
+    while (wait4(running_client, &status, 0, &usage) == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("Error: Could not wait for the client");
+            exit(EXIT_FAILURE);
+        }
+    }
+    alarm(0);
+    running_client = 0;
+    result.seconds = seconds_since(start);
+    result.client_cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+    std::string copy = dir + "/" + name;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && same_file(copy, server_dir + "/" + name);
+    unlink(copy.c_str());
+
+    unsigned long sends = 0;
+    unsigned long resends = 0;
+    if (result.ok && server_sent(server_log, log_start, client_port, sends, resends))
+        result.retransmit_ratio = sends > resends ? (double)resends / (sends - resends) : 0;
+    else
+    {
+        result.ok = false;
+        result.retransmit_ratio = 0;
+    }
+    result.server_cpu = process_cpu(server) - server_start;
+    result.goodput = result.ok ? result.size / result.seconds / (1024 * 1024) : 0;
+}
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+// Runs a cell of the grid the given number of times and fills in result
+// with the median of each measure. transfers counts the transfers so far,
+// which pick the client ports.
+static void run_cell(const std::string& client, const std::string& dir, const std::string& server_dir,
+    pid_t server, const std::string& server_log, int runs, size_t& transfers, Result& result)
+{
+    std::vector<double> seconds;
+    std::vector<double> retransmit_ratios;
+    std::vector<double> client_cpus;
+    std::vector<double> server_cpus;
+    result.ok = true;
+    for (int run = 0; run < runs; ++run)
+    {
+        Result single = result;
+        int port = BENCH_CLIENT_PORT + (int)(transfers++ % BENCH_CLIENT_PORTS);
+        run_transfer(client, dir, server_dir, server, server_log, port, single);
+        result.ok = result.ok && single.ok;
+        seconds.push_back(single.seconds);
+        retransmit_ratios.push_back(single.retransmit_ratio);
+        client_cpus.push_back(single.client_cpu);
+        server_cpus.push_back(single.server_cpu);
+    }
+    result.seconds = median(seconds);
+    result.retransmit_ratio = median(retransmit_ratios);
+    result.client_cpu = median(client_cpus);
+    result.server_cpu = median(server_cpus);
+    result.goodput = result.ok ? result.size / result.seconds / (1024 * 1024) : 0;
+}
+
+// Fetches the middle half of a file into a copy the client already has,
+// with that half zeroed, and checks the copy comes back whole and with no
+// checkpoint left behind
+static bool check_ranged(const std::string& client, const std::string& dir, const std::string& server_dir,
+    size_t size)
+{
+    std::string name = file_name(size);
+    std::string copy = dir + "/" + name;
+    generate_file(copy, size);
+    int file = open(copy.c_str(), O_WRONLY);
+    static char zeros[64 * 1024];
+    bool ok = file != -1;
+    for (size_t at = size / 4; ok && at < size / 4 * 3; at += sizeof(zeros))
+    {
+        size_t length = size / 4 * 3 - at < sizeof(zeros) ? size / 4 * 3 - at : sizeof(zeros);
+        ok = pwrite(file, zeros, length, at) == (ssize_t)length;
+    }
+    if (file != -1)
+        close(file);
+
+    char port[16];
+    char client_port[16];
+    char offset[32];
+    char length[32];
+    snprintf(port, sizeof(port), "%d", SERVER_PORT);
+    snprintf(client_port, sizeof(client_port), "%d", BENCH_CLIENT_PORT);
+    snprintf(offset, sizeof(offset), "%zu", size / 4);
+    snprintf(length, sizeof(length), "%zu", size / 4 * 3 - size / 4);
+    std::vector<std::string> args;
+    args.push_back(client);
+    args.push_back("-q");
+    args.push_back("-o");
+    args.push_back(offset);
+    args.push_back("-l");
+    args.push_back(length);
+    args.push_back(client_port);
+    args.push_back("127.0.0.1");
+    args.push_back(port);
+    args.push_back("GET");
+    args.push_back(name);
+
+    int status = 0;
+    if (ok)
+    {
+        running_client = spawn(dir, "", args);
+        alarm(BENCH_TIMEOUT_SEC);
+        while (waitpid(running_client, &status, 0) == -1 && errno == EINTR)
+            ;
+        alarm(0);
+        running_client = 0;
+    }
+    std::string checkpoint = copy + ".part";
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 && same_file(copy, server_dir + "/" + name)
+        && access(checkpoint.c_str(), F_OK) == -1;
+    unlink(copy.c_str());
+    unlink(checkpoint.c_str());
+    return ok;
+}
+
+static std::string result_key(size_t size, const Gremlin& gremlin, const std::string& mode)
+{
+    char key[128];
+    snprintf(key, sizeof(key), "%zu,%d,%d,%d,%d,%s", size, gremlin.corrupt, gremlin.loss, gremlin.delay,
+        gremlin.delay_ms, mode.c_str());
+    return key;
+}
+
+static void write_row(FILE* csv, const Result& result)
+{
+    fprintf(csv, "%s,%d,%.6f,%.3f,%.6f,%.4f,%.4f\n",
+        result_key(result.size, result.gremlin, result.mode).c_str(), result.ok ? 1 : 0, result.seconds,
+        result.goodput, result.retransmit_ratio, result.client_cpu, result.server_cpu);
+    fflush(csv);
+}
+
+// Reads the rows of an earlier results file, by key
+static std::map<std::string, Result> read_baseline(const char* path)
+{
+    std::map<std::string, Result> baseline;
+    FILE* csv = fopen(path, "r");
+    if (csv == NULL)
+        return baseline;
+    char line[512];
+    while (fgets(line, sizeof(line), csv) != NULL)
+    {
+        Result row;
+        char mode[16];
+        int ok;
+        if (sscanf(line, "%zu,%d,%d,%d,%d,%15[^,],%d,%lf,%lf,%lf,%lf,%lf", &row.size, &row.gremlin.corrupt,
+                &row.gremlin.loss, &row.gremlin.delay, &row.gremlin.delay_ms, mode, &ok, &row.seconds,
+                &row.goodput, &row.retransmit_ratio, &row.client_cpu, &row.server_cpu) != 12)
+            continue;
+        row.mode = mode;
+        row.ok = ok != 0;
+        baseline[result_key(row.size, row.gremlin, row.mode)] = row;
+    }
+    fclose(csv);
+    return baseline;
+}
+
+// Describes how result compares to its baseline row in note, and returns
+// true if it is a regression
+static bool compare(const Result& result, const std::map<std::string, Result>& baseline, double tolerance,
+    char* note, size_t length)
+{
+    if (!result.ok)
+    {
+        snprintf(note, length, "FAILED");
+        return true;
+    }
+    std::map<std::string, Result>::const_iterator found =
+        baseline.find(result_key(result.size, result.gremlin, result.mode));
+    if (found == baseline.end() || !found->second.ok)
+    {
+        snprintf(note, length, "no baseline");
+        return false;
+    }
+    const Result& base = found->second;
+    double change = (result.goodput - base.goodput) / base.goodput * 100;
+    // Small transfers and ratios near zero are allowed some absolute slack
+    // too, or scheduling noise and a single extra retransmission would count
+    bool slower = result.seconds > base.seconds * (1 + tolerance) + BENCH_SECONDS_SLACK;
+    bool retransmits = result.retransmit_ratio > base.retransmit_ratio * (1 + tolerance) + BENCH_RATIO_SLACK;
+    snprintf(note, length, "%+.0f%%%s%s", change, slower ? " SLOWER" : "", retransmits ? " MORE RETRANSMITS" : "");
+    return slower || retransmits;
+}
+
+int main(int argc, char** argv)
+{
+    const char* repo = ".";
+    const char* output = "bench/results.csv";
+    const char* baseline_path = "bench/baseline.csv";
+    size_t max_size = SIZES[sizeof(SIZES) / sizeof(SIZES[0]) - 1];
+    double tolerance = BENCH_TOLERANCE / 100.0;
+    int runs = BENCH_RUNS;
+    int option;
+    while ((option = getopt(argc, argv, "r:s:n:o:b:t:")) != -1)
+    {
+        switch (option)
+        {
+            case 'r':
+                repo = optarg;
+            break;
+            case 's':
+                max_size = (size_t)strtoul(optarg, NULL, 0) * 1024 * 1024;
+            break;
+            case 'n':
+                runs = atoi(optarg);
+                if (runs < 1)
+                    runs = 1;
+            break;
+            case 'o':
+                output = optarg;
+            break;
+            case 'b':
+                baseline_path = optarg;
+            break;
+            case 't':
+                tolerance = atof(optarg) / 100;
+            break;
+            default:
+                fprintf(stderr, "Usage: %s [-r repo-dir] [-s max-MB] [-n runs] [-o results.csv] "
+                    "[-b baseline.csv] [-t tolerance-%%]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    char root[PATH_MAX];
+    if (realpath(repo, root) == NULL)
+    {
+        perror("Error: Could not find the repository");
+        exit(EXIT_FAILURE);
+    }
+    std::string server = std::string(root) + "/server/server";
+    std::string client = std::string(root) + "/client/client";
+    if (access(server.c_str(), X_OK) == -1 || access(client.c_str(), X_OK) == -1)
+    {
+        fprintf(stderr, "Error: Build the server and client first\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char scratch[] = "/tmp/transfer_bench.XXXXXX";
+    if (mkdtemp(scratch) == NULL)
+    {
+        perror("Error: Could not create a scratch directory");
+        exit(EXIT_FAILURE);
+    }
+    std::string server_dir = std::string(scratch) + "/server";
+    std::string client_dir = std::string(scratch) + "/client";
+    std::string server_log = std::string(scratch) + "/server.log";
+    mkdir(server_dir.c_str(), 0755);
+    mkdir(client_dir.c_str(), 0755);
+
+    std::vector<size_t> sizes;
+    for (size_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); ++i)
+    {
+        if (SIZES[i] > max_size)
+            continue;
+        sizes.push_back(SIZES[i]);
+        generate_file(server_dir + "/" + file_name(SIZES[i]), SIZES[i]);
+    }
+
+    std::map<std::string, Result> baseline = read_baseline(baseline_path);
+    FILE* csv = fopen(output, "w");
+    if (csv == NULL)
+    {
+        perror("Error: Could not create the results file");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(csv, "size,corrupt,loss,delay,delay_ms,mode,ok,seconds,goodput_mib_s,retransmit_ratio,"
+        "client_cpu,server_cpu\n");
+    signal(SIGALRM, kill_client);
+
+    printf("%-11s %-12s %-4s %10s %10s %10s %10s %10s  %s\n", "size", "gremlin", "mode", "seconds", "MiB/s",
+        "retrans", "client cpu", "server cpu", "vs baseline");
+    int regressions = 0;
+    for (size_t g = 0; g < sizeof(GREMLINS) / sizeof(GREMLINS[0]); ++g)
+    {
+        const Gremlin& gremlin = GREMLINS[g];
+        pid_t server_pid = start_server(server, server_dir, server_log, gremlin);
+        size_t transfers = 0;
+        for (size_t s = 0; s < sizes.size(); ++s)
+        {
+            for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); ++m)
+            {
+                Result result;
+                result.size = sizes[s];
+                result.gremlin = gremlin;
+                result.mode = MODES[m];
+                run_cell(client, client_dir, server_dir, server_pid, server_log, runs, transfers, result);
+                write_row(csv, result);
+
+                char note[64];
+                if (compare(result, baseline, tolerance, note, sizeof(note)))
+                    regressions++;
+                char setting[32];
+                snprintf(setting, sizeof(setting), "%d %d %d %d", gremlin.corrupt, gremlin.loss, gremlin.delay,
+                    gremlin.delay_ms);
+                printf("%-11zu %-12s %-4s %10.3f %10.1f %10.4f %10.3f %10.3f  %s\n", result.size, setting,
+                    result.mode.c_str(), result.seconds, result.goodput, result.retransmit_ratio,
+                    result.client_cpu, result.server_cpu, note);
+                fflush(stdout);
+            }
+        }
+        stop_server(server_pid);
+    }
+    fclose(csv);
+
+    if (!sizes.empty())
+    {
+        pid_t server_pid = start_server(server, server_dir, server_log, GREMLINS[0]);
+        size_t ranged_size = sizes.size() > 1 ? sizes[1] : sizes[0];
+        bool ranged = check_ranged(client, client_dir, server_dir, ranged_size);
+        stop_server(server_pid);
+        printf("\nRanged fetch into an existing %zu-byte copy: %s\n", ranged_size, ranged ? "intact" : "DAMAGED");
+        if (!ranged)
+            regressions++;
+    }
+
+    for (size_t s = 0; s < sizes.size(); ++s)
+        unlink((server_dir + "/" + file_name(sizes[s])).c_str());
+    unlink(server_log.c_str());
+    rmdir(server_dir.c_str());
+    rmdir(client_dir.c_str());
+    rmdir(scratch);
+
+    printf("\nResults in %s; %d regression%s against %s\n", output, regressions, regressions == 1 ? "" : "s",
+        baseline.empty() ? "no baseline" : baseline_path);
+    return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
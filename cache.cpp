@@ -0,0 +1,64 @@
+/// @file cache.cpp
+///
+/// A small LRU of packetized files, so that a file many clients ask for is
+/// read and checksummed once rather than once per transfer.
+
+#include "cache.h"
+
+PacketCache::PacketCache(size_t capacity)
+	: _capacity(capacity), _bytes(0)
+{
+}
+
+void PacketCache::erase(std::map<std::string, Entry>::iterator entry)
+{
+	_bytes -= entry->second.image->bytes;
+	_order.erase(entry->second.used);
+	_entries.erase(entry);
+}
+
+std::shared_ptr<PacketImage> PacketCache::find(const std::string& key, const struct stat& info)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	std::map<std::string, Entry>::iterator found = _entries.find(key);
+	if (found == _entries.end())
+		return std::shared_ptr<PacketImage>();
+
+	// The file has changed since the image was built
+	const PacketImage& image = *found->second.image;
+	if (image.file_size != info.st_size || image.file_mtime.tv_sec != info.st_mtim.tv_sec
+		|| image.file_mtime.tv_nsec != info.st_mtim.tv_nsec)
+	{
+		erase(found);
+		return std::shared_ptr<PacketImage>();
+	}
+
+	_order.splice(_order.begin(), _order, found->second.used);
+	return found->second.image;
+}
+
+bool PacketCache::claim(const std::string& key)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _building.insert(key).second;
+}
+
+void PacketCache::insert(const std::string& key, std::shared_ptr<PacketImage> image)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_building.erase(key);
+	if (!image)
+		return;
+
+	std::map<std::string, Entry>::iterator found = _entries.find(key);
+	if (found != _entries.end())
+		erase(found);
+	while (!_order.empty() && _bytes + image->bytes > _capacity)
+		erase(_entries.find(_order.back()));
+
+	_order.push_front(key);
+	Entry& entry = _entries[key];
+	entry.image = image;
+	entry.used = _order.begin();
+	_bytes += image->bytes;
+}
@@ -0,0 +1,85 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include "util.h"
+
+// Room for packetized files, and the largest share of it one file may take
+#define CACHE_DEFAULT_BYTES (64 * 1024 * 1024)
+#define CACHE_FILE_SHARE 4
+
+/// Every packet of one transfer, read and sealed once, and the size and
+/// modification time of the file it was read from. Nothing writes to an
+/// image once it is built, so any number of transfers on any thread may send
+/// straight from it.
+struct PacketImage
+{
+	PacketSlots packets;
+	size_t bytes;
+	off_t file_size;
+	struct timespec file_mtime;
+};
+
+/// Packetized file images shared by every transfer the server runs, up to a
+/// total size, dropping the least recently used first. An image is keyed by
+/// the path and the request's layout, payload size, wire version, checksum
+/// and compression, and is only handed out while the file still has the size
+/// and modification time it was built from; a stale one is dropped when it
+/// is looked up. Transfers hold their image by shared_ptr, so one that is
+/// evicted mid-transfer lives on until they are done with it.
+///
+/// Images are built away from the event loops. The transfer that misses
+/// claims the key, so only one build of an image runs at a time, and
+/// inserting the image gives the claim up.
+class PacketCache
+{
+private:
+	typedef std::list<std::string> Order;
+	struct Entry
+	{
+		std::shared_ptr<PacketImage> image;
+		Order::iterator used;
+	};
+
+	std::mutex _lock;
+	std::map<std::string, Entry> _entries;
+	std::set<std::string> _building;
+	Order _order;
+	size_t _capacity;
+	size_t _bytes;
+
+	void erase(std::map<std::string, Entry>::iterator entry);
+
+	PacketCache(const PacketCache&);
+	PacketCache& operator=(const PacketCache&);
+
+public:
+	explicit PacketCache(size_t capacity = CACHE_DEFAULT_BYTES);
+
+	/// Whether an image of the given size is worth building at all.
+	bool fits(size_t bytes) { return _capacity > 0 && bytes <= _capacity / CACHE_FILE_SHARE; }
+
+	/// The image stored under key if it was built from the file as info
+	/// describes it, or an empty pointer.
+	std::shared_ptr<PacketImage> find(const std::string& key, const struct stat& info);
+
+	/// Claims the building of the image for key. Returns false if it is
+	/// already being built.
+	bool claim(const std::string& key);
+
+	/// Stores a newly built image in place of any older one, making room for
+	/// it, and gives up the claim on key. An empty image only gives up the
+	/// claim.
+	void insert(const std::string& key, std::shared_ptr<PacketImage> image);
+};
+
+#endif
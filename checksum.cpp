@@ -0,0 +1,254 @@
+/// @file checksum.cpp
+///
+/// Packet checksums. Each algorithm has a portable implementation and a SIMD
+/// one; the SIMD code is compiled for its own target so the rest of the build
+/// needs no special flags, and is only called once the CPU is known to
+/// support it.
+
+#include <string.h>
+#include <numeric>
+#include <immintrin.h>
+
+#include "checksum.h"
+
+// Reflected CRC32C (Castagnoli) polynomial
+#define CRC32C_POLY 0x82F63B78
+
+static bool always_supported()
+{
+	return true;
+}
+
+static bool has_sse42()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+static bool has_avx2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+// The version 1 checksum: the payload's bytes summed into a byte
+static uint32_t byte_sum_scalar(const char* data, size_t length)
+{
+	return std::accumulate(data, data + length, (unsigned char) 0);
+}
+
+// Sums 32 bytes at a time with the sum-of-absolute-differences instruction
+__attribute__((target("avx2")))
+static uint32_t byte_sum_avx2(const char* data, size_t length)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sums = zero;
+	for (; length >= 32; data += 32, length -= 32)
+	{
+		__m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+		sums = _mm256_add_epi64(sums, _mm256_sad_epu8(bytes, zero));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, sums);
+	uint64_t sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (; length > 0; ++data, --length)
+		sum += (unsigned char)*data;
+	return sum & 0xFF;
+}
+
+// Slicing-by-8 lookup tables: table[k][b] is the CRC of byte b followed by
+// k zero bytes
+struct Crc32cTables
+{
+	uint32_t table[8][256];
+
+	Crc32cTables()
+	{
+		for (int b = 0; b < 256; ++b)
+		{
+			uint32_t crc = b;
+			for (int bit = 0; bit < 8; ++bit)
+				crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+			table[0][b] = crc;
+		}
+		for (int k = 1; k < 8; ++k)
+		{
+			for (int b = 0; b < 256; ++b)
+				table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+		}
+	}
+};
+
+static uint32_t crc32c_table(const char* data, size_t length)
+{
+	static Crc32cTables tables;
+	const uint32_t (*t)[256] = tables.table;
+	const uint8_t* bytes = (const uint8_t*)data;
+	uint32_t crc = 0xFFFFFFFF;
+
+	for (; length >= 8; bytes += 8, length -= 8)
+	{
+		uint32_t low;
+		uint32_t high;
+		memcpy(&low, bytes, sizeof(low));
+		memcpy(&high, bytes + 4, sizeof(high));
+		low ^= crc;
+		crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+			^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+	}
+	for (; length > 0; ++bytes, --length)
+		crc = t[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const char* data, size_t length)
+{
+	uint64_t crc = 0xFFFFFFFF;
+	for (; length >= 8; data += 8, length -= 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		crc = _mm_crc32_u64(crc, word);
+	}
+
+	uint32_t crc32 = (uint32_t)crc;
+	for (; length > 0; ++data, --length)
+		crc32 = _mm_crc32_u8(crc32, (uint8_t)*data);
+	return ~crc32;
+}
+
+// Adds little-endian 16-bit words to a running ones'-complement sum, with a
+// trailing odd byte padded by a zero
+static uint64_t internet_add(uint64_t sum, const char* data, size_t length)
+{
+	for (; length >= 4; data += 4, length -= 4)
+	{
+		uint32_t word;
+		memcpy(&word, data, sizeof(word));
+		sum += word;
+	}
+	if (length >= 2)
+	{
+		uint16_t word;
+		memcpy(&word, data, sizeof(word));
+		sum += word;
+		data += 2;
+		length -= 2;
+	}
+	if (length > 0)
+		sum += (unsigned char)*data;
+	return sum;
+}
+
+// Folds the carries back in (RFC 1071) and complements the result
+static uint32_t internet_fold(uint64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum & 0xFFFF;
+}
+
+static uint32_t internet_scalar(const char* data, size_t length)
+{
+	return internet_fold(internet_add(0, data, length));
+}
+
+// Adds the low and high halves of each 32-bit lane separately so no lane can
+// overflow within a run of up to 65536 vectors
+__attribute__((target("avx2")))
+static uint32_t internet_avx2(const char* data, size_t length)
+{
+	const __m256i low_mask = _mm256_set1_epi32(0xFFFF);
+	uint64_t sum = 0;
+
+	while (length >= 32)
+	{
+		size_t run = length / 32;
+		if (run > 65536)
+			run = 65536;
+		length -= run * 32;
+
+		__m256i low = _mm256_setzero_si256();
+		__m256i high = _mm256_setzero_si256();
+		for (; run > 0; --run, data += 32)
+		{
+			__m256i words = _mm256_loadu_si256((const __m256i*)data);
+			low = _mm256_add_epi32(low, _mm256_and_si256(words, low_mask));
+			high = _mm256_add_epi32(high, _mm256_srli_epi32(words, 16));
+		}
+
+		uint32_t lanes[16];
+		_mm256_storeu_si256((__m256i*)lanes, low);
+		_mm256_storeu_si256((__m256i*)(lanes + 8), high);
+		for (int i = 0; i < 16; ++i)
+			sum += lanes[i];
+	}
+
+	return internet_fold(internet_add(sum, data, length));
+}
+
+static const ChecksumVariant variants[] =
+{
+	{ "byte-sum/scalar", CHECKSUM_BYTE_SUM, byte_sum_scalar, always_supported },
+	{ "byte-sum/avx2", CHECKSUM_BYTE_SUM, byte_sum_avx2, has_avx2 },
+	{ "crc32c/table", CHECKSUM_CRC32C, crc32c_table, always_supported },
+	{ "crc32c/sse4.2", CHECKSUM_CRC32C, crc32c_sse42, has_sse42 },
+	{ "internet/scalar", CHECKSUM_INTERNET, internet_scalar, always_supported },
+	{ "internet/avx2", CHECKSUM_INTERNET, internet_avx2, has_avx2 },
+};
+
+// The implementation each algorithm uses on this CPU: the last supported
+// variant in the table
+struct ChecksumDispatch
+{
+	uint32_t (*function[3])(const char* data, size_t length);
+
+	ChecksumDispatch()
+	{
+		for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i)
+		{
+			if (variants[i].supported())
+				function[variants[i].algorithm] = variants[i].function;
+		}
+	}
+};
+
+static ChecksumDispatch& dispatch()
+{
+	static ChecksumDispatch chosen;
+	return chosen;
+}
+
+uint32_t checksum(uint8_t algorithm, const char* data, size_t length)
+{
+	if (algorithm > CHECKSUM_INTERNET)
+		algorithm = CHECKSUM_CRC32C;
+	return dispatch().function[algorithm](data, length);
+}
+
+uint8_t checksum_preferred()
+{
+	return has_sse42() ? CHECKSUM_CRC32C : CHECKSUM_INTERNET;
+}
+
+const char* checksum_name(uint8_t algorithm)
+{
+	switch (algorithm)
+	{
+		case CHECKSUM_BYTE_SUM:
+			return "byte-sum";
+		case CHECKSUM_CRC32C:
+			return "crc32c";
+		case CHECKSUM_INTERNET:
+			return "internet";
+	}
+	return "unknown";
+}
+
+const ChecksumVariant* checksum_variants(size_t& count)
+{
+	count = sizeof(variants) / sizeof(variants[0]);
+	return variants;
+}
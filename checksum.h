@@ -0,0 +1,39 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Checksum algorithms. Versions 1 to 3 of the wire format always use the
+// byte sum over the payload alone; from version 4 on the sender names the
+// algorithm in the header and the checksum covers header and payload.
+#define CHECKSUM_BYTE_SUM 0
+#define CHECKSUM_CRC32C 1
+#define CHECKSUM_INTERNET 2
+
+/// Checksums length bytes with the given algorithm, using the fastest
+/// implementation the CPU supports.
+uint32_t checksum(uint8_t algorithm, const char* data, size_t length);
+
+/// The algorithm this machine computes fastest among the strong ones:
+/// CRC32C where the CPU has the SSE4.2 crc32 instruction, otherwise the
+/// ones'-complement sum.
+uint8_t checksum_preferred();
+
+const char* checksum_name(uint8_t algorithm);
+
+/// One implementation of an algorithm. Every variant of an algorithm gives
+/// the same result; they only differ in speed and in the CPU features they
+/// need.
+struct ChecksumVariant
+{
+	const char* name;
+	uint8_t algorithm;
+	uint32_t (*function)(const char* data, size_t length);
+	bool (*supported)();
+};
+
+/// All the built in variants, for benchmarks and self checks.
+const ChecksumVariant* checksum_variants(size_t& count);
+
+#endif
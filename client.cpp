@@ -17,46 +17,144 @@
 #include <algorithm>
 #include <stdint.h>
 #include <errno.h>
+#include <poll.h>
 #include <iostream>
 #include <numeric>
+#include <thread>
+#include <vector>
 
 #include "client.h"
+#include "compress.h"
+#include "fec.h"
+#include "log.h"
+#include "netio.h"
 #include "util.h"
 #include "timers.h"
 
 //#define SERVER_PORT 10050
 
 #define TIMEOUT_SEC 0
-#define TIMEOUT_USEC 3000
+#define TIMEOUT_USEC 50000
 #define CLIENT_SERVER_DEAD_TIMEOUT_MS 5000
-
-
-std::string packet_string(Packet& packet)
-{
-    char temp[PACKET_SIZE];
-    memset(temp, '\0', PACKET_SIZE);
-    memcpy(temp, packet.data(), packet.size());
-    std::string result(temp);
-    return result;
-}
-
-std::string packet_string(Packet& packet, size_t size)
-{
-    size_t amount = packet.size();
-    if (amount > size)
-        amount = size;
-    char temp[PACKET_SIZE];
-    memset(temp, '\0', PACKET_SIZE);
-    memcpy(temp, packet.data(), amount);
-    std::string result(temp);
-    return result;
-}
+#define CLIENT_REQUEST_RETRY_MS 500
+#define CLIENT_MIN_RCVBUF (1024 * 1024)
+#define CLIENT_MAX_RCVBUF (64 * 1024 * 1024)
+// Kernel bookkeeping charged against the receive buffer for every datagram
+#define CLIENT_DATAGRAM_OVERHEAD 768
+// In-order packets covered by one ACK, and how long the first of them may
+// wait for the rest
+#define CLIENT_ACK_EVERY 2
+#define CLIENT_ACK_DELAY_USEC 500
+// A striped transfer deals the file out in blocks of about this many bytes,
+// so each stream's writes stay large and sequential
+#define CLIENT_STRIPE_BLOCK_BYTES (1024 * 1024)
+
+using std::vector;
 
 int main(int argc, char** argv)
 {
-    if(argc != 6) {
+    Request request;
+    request_defaults(request);
+    request.checksum = checksum_preferred();
+    int level = LOG_DEFAULT_LEVEL;
+    AckPolicy policy;
+    policy.every = CLIENT_ACK_EVERY;
+    policy.delay_nsec = (nano_t)CLIENT_ACK_DELAY_USEC * 1000;
+    int streams = 1;
+    bool ranged = false;
+    bool gro = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:m:c:a:d:n:o:l:f:gzvq")) != -1)
+    {
+        switch (option)
+        {
+            case 'g':
+                gro = true;
+            break;
+            case 'z':
+                request.compression = COMPRESSION_LZ;
+            break;
+            case 'f':
+            {
+                int group = 0;
+                int parity = 0;
+                if (sscanf(optarg, "%d:%d", &group, &parity) != 2 || group < 1 || group > FEC_MAX_GROUP
+                    || parity < 1 || parity > FEC_MAX_PARITY)
+                    argc = 0;
+                request.fec_group = (uint8_t)group;
+                request.fec_parity = (uint8_t)parity;
+            }
+            break;
+            case 'o':
+                request.offset = strtoull(optarg, NULL, 0);
+                ranged = true;
+            break;
+            case 'l':
+                request.length = strtoull(optarg, NULL, 0);
+                ranged = true;
+            break;
+            case 'n':
+                streams = atoi(optarg);
+                if (streams < 1 || streams > MAX_STRIPES)
+                    argc = 0;
+            break;
+            case 'a':
+                policy.every = atoi(optarg);
+                if (policy.every < 1)
+                    argc = 0;
+            break;
+            case 'd':
+                policy.delay_nsec = (nano_t)strtoul(optarg, NULL, 0) * 1000;
+            break;
+            case 'c':
+                if (!strcmp(optarg, "crc32c"))
+                    request.checksum = CHECKSUM_CRC32C;
+                else if (!strcmp(optarg, "internet"))
+                    request.checksum = CHECKSUM_INTERNET;
+                else
+                    argc = 0;
+            break;
+            case 's':
+                request.payload_size = (uint16_t) strtoul(optarg, NULL, 0);
+            break;
+            case 'm':
+                if (!strcmp(optarg, "sr"))
+                    request.mode = MODE_SELECTIVE_REPEAT;
+                else if (!strcmp(optarg, "gbn"))
+                    request.mode = MODE_GO_BACK_N;
+                else
+                    argc = 0;
+            break;
+            case 'v':
+                level++;
+            break;
+            case 'q':
+                level = LOG_WARN;
+            break;
+            default:
+                argc = 0;
+            break;
+        }
+    }
+
+    if(argc - optind != 5) {
         std::cout << "Usage: " << argv[0] << " ";
-        std::cout << "<client-port> <server-IP> <server-port> <func> <filename> \n";
+        std::cout << "[-s payload-bytes] [-m gbn|sr] [-c crc32c|internet] [-a ack-every] [-d ack-delay-us] [-n streams] [-o offset] [-l length] [-f data:parity] [-g] [-z] [-v] [-q] <client-port> <server-IP> <server-port> <func> <filename> \n";
+        exit(EXIT_FAILURE);
+    }
+    argv += optind - 1;
+
+    if (request.payload_size < MIN_PAYLOAD_SIZE || request.payload_size > MAX_PAYLOAD_SIZE)
+    {
+        std::cerr << "Error: Payload size must be between " << MIN_PAYLOAD_SIZE
+            << " and " << MAX_PAYLOAD_SIZE << " bytes" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (request.fec_group > 0 && request.payload_size > MAX_PAYLOAD_SIZE - FEC_OVERHEAD)
+    {
+        std::cerr << "Error: Payload size with parity must be at most "
+            << MAX_PAYLOAD_SIZE - FEC_OVERHEAD << " bytes" << std::endl;
         exit(EXIT_FAILURE);
     }
 
@@ -65,11 +163,8 @@ int main(int argc, char** argv)
     char* type = argv[4];
     char* filename = argv[5];
 
-    int sockfd;
     uint8_t packet_type = 255;
     struct sockaddr_in server;
-    struct sockaddr_in client;
-    socklen_t slen = sizeof(server);
 
     // Parse the given server IP address
     if(inet_aton(argv[2], &server.sin_addr) == 0)
@@ -89,7 +184,77 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    // Stream i listens on client_port + i and asks for stripe i of the file
+    vector<int> sockets;
+    for (int i = 0; i < streams; ++i)
+    {
+        sockets.push_back(open_client_socket(client_port + i, request));
+        if (gro && !RecvBatch::enable_gro(sockets[i]))
+        {
+            std::cerr << "Warning: receive offload is not supported, continuing without it" << std::endl;
+            gro = false;
+        }
+    }
+
+    server.sin_family = AF_INET;
+    server.sin_port = htons(server_port);
+
+    log_open(level);
+    LOG_TEXT(LOG_INFO, "Attempting to talk with server at %s:%u\n", argv[2], LOG_TEXT_SIZE, server_port);
+    request.filename = filename;
+
+    // An interrupted transfer of the same file carries on from its checkpoint,
+    // as long as the server's copy has not changed since
+    FileInfo resume_info;
+    if (!ranged) {
+        request.offset = FileWriter::resume_point(request.filename, resume_info);
+        request.info = 1;
+    }
+    if (request.offset > 0)
+        LOG(LOG_INFO, "Continuing from byte %u\n", request.offset);
+
+    FileWriter writer;
+    if (!writer.open(request.filename, request.offset, ranged))
+    {
+        std::cerr << "Error: Could not open output file: " << request.filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (request.offset > 0)
+        writer.identify(resume_info);
+
+    vector<Request> stripes(streams, request);
+    vector<std::thread> workers;
+    for (int i = 0; i < streams; ++i)
+    {
+        if (streams > 1)
+        {
+            stripes[i].stripes = streams;
+            stripes[i].stripe = i;
+            stripes[i].stripe_block = CLIENT_STRIPE_BLOCK_BYTES / request.payload_size;
+        }
+        if (i > 0)
+            workers.push_back(std::thread(receive_stream, sockets[i], std::ref(stripes[i]), server,
+                std::ref(policy), std::ref(writer)));
+    }
+    receive_stream(sockets[0], stripes[0], server, policy, writer);
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    // Only report success once the whole file is safely on disk
+    if (!writer.finish())
+    {
+        fprintf(stderr, "Error: Could not write to the output file\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < streams; ++i)
+        send_success(sockets[i], server);
+}
+
+// Creates the socket a stream receives on, bound to the given port, with a
+// receive buffer sized for the datagrams the request asks for
+int open_client_socket(unsigned short port, Request& request)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0)
     {
         std::cerr << "Error: Could not create client socket.\n\n";
@@ -102,37 +267,48 @@ int main(int argc, char** argv)
     tv.tv_usec = TIMEOUT_USEC;
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(struct timeval));
 
+    // Ask for room for the largest window of the datagrams we asked for; the
+    // kernel caps this at net.core.rmem_max and the window we advertise
+    // follows whatever we actually get
+    size_t wanted = (size_t)MAX_WINDOW_SIZE * (HEADER_SIZE + request.payload_size + CLIENT_DATAGRAM_OVERHEAD);
+    if (wanted > CLIENT_MAX_RCVBUF)
+        wanted = CLIENT_MAX_RCVBUF;
+    int rcvbuf = wanted < CLIENT_MIN_RCVBUF ? CLIENT_MIN_RCVBUF : (int)wanted;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (char*)&rcvbuf, sizeof(rcvbuf));
+
     // Set all the information on the client address struct
+    struct sockaddr_in client;
     client.sin_family = AF_INET;
-    client.sin_port = htons(client_port);
+    client.sin_port = htons(port);
     client.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if (bind(sockfd, (struct sockaddr*) &client, sizeof(client)) == -1)
     {
-        std::cerr << "Error: Could not bind client process to port " << client_port << std::endl;
+        std::cerr << "Error: Could not bind client process to port " << port << std::endl;
         close(sockfd);
         exit(EXIT_FAILURE);
     }
+    return sockfd;
+}
 
-    server.sin_family = AF_INET;
-    server.sin_port = htons(server_port);
-
-    std::cout << "Attempting to talk with server at " << argv[2] << ":" << argv[3] << std::endl;
-    std::string str_filename(filename);
-
-    request_func(sockfd, filename, str_filename.size(), server);
+// Fetches one stream's share of the file into the writer
+void receive_stream(int sockfd, Request& request, sockaddr_in server, AckPolicy& policy, FileWriter& writer)
+{
+    if (request.stripes > 1)
+        LOG(LOG_INFO, "Requesting stripe %u of %u\n", request.stripe + 1, request.stripes);
+    request_func(sockfd, request, server);
     //COMMENCE LISTENING
-    receive_func(sockfd, filename, server);
+    receive_func(sockfd, request, server, policy, writer);
 }
 
-
 // request file
-void request_func(int sockfd, char* filename, size_t length, sockaddr_in server)
+void request_func(int sockfd, Request& request, sockaddr_in server)
 {
     socklen_t slen = sizeof(server);
-    Packet packet = Packet(filename, length, 0, GET);
+    Packet packet;
+    build_request(packet, request);
 
-    if (sendto(sockfd, packet.buffer, PACKET_SIZE, 0, (struct sockaddr*) &server, slen) == -1)
+    if (sendto(sockfd, packet.buffer, packet.length(), 0, (struct sockaddr*) &server, slen) == -1)
     {
         perror("Error: could not send acknowledge to client\n");
         close(sockfd);
@@ -141,35 +317,230 @@ void request_func(int sockfd, char* filename, size_t length, sockaddr_in server)
 }
 
 // receive file
-void receive_func(int sockfd, char* filename, sockaddr_in server)
+// Hands an in-order packet to the writer at its place in the file. Returns
+// false once the empty final packet has arrived. Exits if the file can no
+// longer be written.
+bool deliver_packet(Packet& packet, Delivery& delivery)
 {
-    socklen_t slen = sizeof(server);
-    Packet packet;
-    int cur_seq;
-    int exp_seq = 0;
+    if (packet.size() > 0)
+    {
+        LOG_TEXT(LOG_DEBUG, "RECEIVED: sequence %u\nDATA:\n\n%s\n\n", packet.data(), packet.size(), packet.sequence());
+        Request& request = *delivery.request;
+        char* data = packet.data();
+        long size = packet.size();
+        if (packet.flags() & PACKET_FLAG_COMPRESSED)
+        {
+            size = lz_decompress(data, size, delivery.expanded.data(), delivery.expanded.size());
+            if (size <= 0)
+            {
+                fprintf(stderr, "Error: Could not decompress packet %u\n", (unsigned)packet.sequence());
+                exit(EXIT_FAILURE);
+            }
+            data = delivery.expanded.data();
+            delivery.compressed++;
+        }
+
+        off_t offset = request.offset + (off_t)stripe_payload(request, delivery.delivered++) * request.payload_size;
+        delivery.writer->seek(delivery.stream, offset);
+        if (!delivery.writer->append(delivery.stream, data, size))
+        {
+            fprintf(stderr, "Error: Could not write to the output file\n");
+            exit(EXIT_FAILURE);
+        }
+        return true;
+    }
+
+    LOG(LOG_INFO, "RECEIVED: close packet for file transfer: closing transfer\n\n");
+    return false;
+}
+
+// The receive window to advertise: as many of the requested datagrams as
+// the socket's receive buffer can queue
+uint16_t receive_window(int sockfd, Request& request)
+{
+    int rcvbuf = 0;
+    socklen_t optlen = sizeof(rcvbuf);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (char*)&rcvbuf, &optlen) == -1)
+        return WINDOW_SIZE;
+
+    size_t window = rcvbuf / (HEADER_SIZE + request.payload_size + CLIENT_DATAGRAM_OVERHEAD);
+    if (window < 1)
+        window = 1;
+    if (window > MAX_WINDOW_SIZE)
+        window = MAX_WINDOW_SIZE;
+    return (uint16_t)window;
+}
+
+// Lists the runs of held packets between exp_seq and highest as SACK
+// blocks, lowest first, as many as fit in an ACK. When there are more runs
+// than that, half the blocks go to the highest runs, so a packet that just
+// arrived is always reported; the server remembers the ones in between
+// from earlier ACKs.
+void collect_sack(Ack& ack, vector<bool>& have, uint32_t exp_seq, uint32_t highest)
+{
+    size_t mask = have.size() - 1;
+
+    // Walk down from highest for the highest runs
+    SackBlock recent[ACK_MAX_SACK_BLOCKS / 2];
+    int recent_count = 0;
+    uint32_t floor = highest;
+    while (floor != exp_seq && recent_count < ACK_MAX_SACK_BLOCKS / 2)
+    {
+        if (!have[(floor - 1) & mask])
+        {
+            floor--;
+            continue;
+        }
+        recent[recent_count].end = floor;
+        while (floor != exp_seq && have[(floor - 1) & mask])
+            floor--;
+        recent[recent_count].start = floor;
+        recent_count++;
+    }
+
+    // Then up from exp_seq for the lowest, in what room is left
+    ack.sack_count = 0;
+    for (uint32_t seq = exp_seq; seq != floor; ++seq)
+    {
+        if (!have[seq & mask])
+            continue;
+        if (ack.sack_count > 0 && ack.sack[ack.sack_count - 1].end == seq)
+        {
+            ack.sack[ack.sack_count - 1].end++;
+        }
+        else if (ack.sack_count + recent_count < ACK_MAX_SACK_BLOCKS)
+        {
+            ack.sack[ack.sack_count].start = seq;
+            ack.sack[ack.sack_count].end = seq + 1;
+            ack.sack_count++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    while (recent_count > 0)
+        ack.sack[ack.sack_count++] = recent[--recent_count];
+}
+
+// Waits up to timeout_nsec for the socket to have something to read.
+// Returns true if it does.
+bool wait_readable(int sockfd, nano_t timeout_nsec)
+{
+    struct pollfd watch;
+    watch.fd = sockfd;
+    watch.events = POLLIN;
+    watch.revents = 0;
+
+    timespec timeout;
+    timeout.tv_sec = timeout_nsec / NANO_PER_SEC;
+    timeout.tv_nsec = timeout_nsec % NANO_PER_SEC;
+    return ppoll(&watch, 1, &timeout, NULL) > 0;
+}
+
+void receive_func(int sockfd, Request& request, sockaddr_in server, AckPolicy& policy, FileWriter& writer)
+{
+    uint32_t cur_seq;
+    uint32_t exp_seq = 0;
+    int64_t reply_seq = 0;
     bool send_ack = false;
     bool send_nak = false;
-    FILE *outfile;
-    outfile = fopen(filename, "wb");
+    Delivery delivery;
+    delivery.writer = &writer;
+    delivery.request = &request;
+    delivery.delivered = 0;
+    delivery.compressed = 0;
+    delivery.expanded.resize(request.payload_size);
+
+    RecvBatch inbox;
+    SendBatch replies(sockfd);
+    Ack reply;
+    reply.window = receive_window(sockfd, request);
+    reply.sack_count = 0;
+
+    // Selective Repeat holds packets that arrive ahead of exp_seq here, in a
+    // power of two sized ring so slots stay put when sequence numbers wrap.
+    // With parity on, any mode holds them, and the ring also keeps the
+    // delivered part of a group a lost packet may be rebuilt from.
+    bool fec = request.fec_group > 0;
+    bool selective = request.mode == MODE_SELECTIVE_REPEAT || fec;
+    size_t slots = 1;
+    while (slots < (size_t)reply.window + request.fec_group)
+        slots <<= 1;
+    PacketSlots held;
+    if (selective)
+        held.assign(slots, request.payload_size);
+    vector<bool> have(slots, false);
+    FecDecoder repair;
+    repair.open(request, slots);
+    uint32_t rebuilt[FEC_MAX_PARITY];
+    uint32_t unrepaired[FEC_MAX_GROUP];
+    uint64_t repaired = 0;
+    bool try_repair = false;
+    // How many packets have arrived while exp_seq stayed a hole
+    uint32_t stalled_seq = exp_seq;
+    size_t stalled = 0;
+
+    // One past the highest held sequence number, and whether the SACK
+    // blocks in reply need building again from have
+    uint32_t highest = 0;
+    bool sack_stale = false;
+
+    // In-order packets received since the last ACK went out, and how long
+    // the first of them has been waiting
+    int unacked = 0;
+    Timer ack_timer;
+    bool in_order = false;
+
+    // Nothing is written or acknowledged until the server has said which
+    // file it is sending, so a changed file is never patched onto the old one
+    bool informed = request.info == 0;
+    FileInfo info;
 
     bool running = true;
-    int timeout_amount = 0;
+    bool heard = false;
+    Timer last_heard;
+    last_heard.start();
+    Timer request_timer;
+    request_timer.start();
     while(running)
     {
+        // A held back ACK goes out once its delay is up, unless more data
+        // arrives first
+        if (unacked > 0 && !wait_readable(sockfd, ack_timer.remaining_nsec(policy.delay_nsec))) {
+            reply.sequence = exp_seq;
+            if (sack_stale) {
+                collect_sack(reply, have, exp_seq, highest);
+                sack_stale = false;
+            }
+            replies.next().set_checksum_type(request.checksum);
+            build_ack(replies.next(), reply, ACK);
+            LOG(LOG_DEBUG, "SENDING ACK: sequence %u (delayed)\n\n", exp_seq);
+            replies.push(server);
+            replies.flush();
+            unacked = 0;
+        }
 
-        if (recvfrom(sockfd, packet.buffer, PACKET_SIZE, 0, (struct sockaddr*)&server, &slen)==-1)
+        int received = inbox.receive(sockfd, true);
+        if (received == -1)
         {
             if (errno == EWOULDBLOCK)
             {
                 errno = 0;
-                std::cout << "TIMEOUT: Server not responding...\n\n";
-                timeout_amount++;
-                if (timeout_amount > 15)
+                LOG(LOG_INFO, "TIMEOUT: Server not responding...\n\n");
+                if (last_heard.timeout(CLIENT_SERVER_DEAD_TIMEOUT_MS))
                 {
                     fprintf(stderr, "Error: Server not responding...ending program\n");
                     close(sockfd);
                     exit(EXIT_FAILURE);
                 }
+                // The request itself may have been lost, so ask again
+                if (!heard && request_timer.timeout(CLIENT_REQUEST_RETRY_MS))
+                {
+                    LOG(LOG_INFO, "RESENDING GET request\n\n");
+                    request_func(sockfd, request, server);
+                    request_timer.start();
+                }
                 continue;
             }
             else
@@ -180,104 +551,270 @@ void receive_func(int sockfd, char* filename, sockaddr_in server)
             }
         }
 
-        timeout_amount = 0;
-
-        uint8_t packet_type = packet.type();
-        uint8_t seq_num = packet.sequence();
-        uint16_t checksum = packet.checksum();
-        uint16_t data_size = packet.size();
-        char* data = packet.data();
-        cur_seq = (int) seq_num;
+        heard = true;
+        last_heard.start();
 
-        send_ack = false;
-        send_nak = false;
+        // Handle the whole batch, then send its ACKs and NAKs together
+        for (int i = 0; i < received && running; ++i)
+        {
+            if (inbox.length(i) < HEADER_SIZE)
+                continue;
 
-        // Switch behavior based on packet type
-        switch(packet_type) {
-            case ACK:
-                std::cout << "ACKNOWLEDGE: Packet discarded" << std::endl << std::endl;
-            break;
-            case NAK:
-                std::cout << "NOT ACKNOWLEDGE: Packet discarded" << std::endl << std::endl;
-            break;
-            case GET:
-                std::cout << "GET: Packet discarded" << std::endl << std::endl;
-            break;
-            break;
-            break;
-            case TRN:
-                if(exp_seq == cur_seq) {
-                    if(checksum == calc_checksum(packet)) {
-                        if(data_size > 0)
-                        {
-                            std::cout << "RECEIVED: sequence " << (int)cur_seq << "\n";
-                            std::cout << "DATA:\n\n";
-                            std::cout << packet_string(packet, 48) << "\n\n";
-                            fwrite(data, 1, data_size, outfile);
-                            //Updating the expected sequence number.
-                            exp_seq = (exp_seq + 1) % SEQ_NUM;
+            // A datagram shorter than its header claims is damaged, and one
+            // split out of a coalesced receive must not be read past its end
+            Packet& packet = inbox.packet(i);
+            if (packet.header_size() + packet.size() > inbox.length(i))
+                continue;
+            uint8_t packet_type = packet.type();
+            uint32_t seq_num = packet.sequence();
+            uint16_t data_size = packet.size();
+            cur_seq = seq_num;
+
+            send_ack = false;
+            send_nak = false;
+            in_order = false;
+            try_repair = false;
+            reply_seq = -1;
+
+            // Switch behavior based on packet type
+            switch(packet_type) {
+                case ACK:
+                    LOG(LOG_DEBUG, "ACKNOWLEDGE: Packet discarded\n\n");
+                break;
+                case NAK:
+                    LOG(LOG_DEBUG, "NOT ACKNOWLEDGE: Packet discarded\n\n");
+                break;
+                case GET:
+                    LOG(LOG_DEBUG, "GET: Packet discarded\n\n");
+                break;
+                break;
+                break;
+                case INF:
+                    if (!parse_info(packet, info)) {
+                        LOG(LOG_DEBUG, "FILE INFO: Packet discarded\n\n");
+                        break;
+                    }
+                    if (!writer.identify(info)) {
+                        std::cerr << "Error: " << request.filename << " has changed on the server since the "
+                            "transfer was interrupted; fetch it again from the start" << std::endl;
+                        unlink((request.filename + WRITER_CHECKPOINT_SUFFIX).c_str());
+                        exit(EXIT_FAILURE);
+                    }
+                    informed = true;
+                break;
+                case TRN:
+                    if (!informed) {
+                        LOG(LOG_DEBUG, "UNIDENTIFIED: sequence %u: Packet discarded\n\n", cur_seq);
+                        break;
+                    }
+                    if (packet.version() != PROTOCOL_VERSION) {
+                        LOG(LOG_WARN, "UNSUPPORTED VERSION %u: Packet discarded\n\n", packet.version());
+                        break;
+                    }
+                    if (selective) {
+                        // ACKs are cumulative and carry SACK blocks for what is
+                        // held; a NAK names the damaged packet
+                        uint32_t offset = cur_seq - exp_seq;
+                        if (!packet.verify()) {
+                            LOG(LOG_DEBUG, "DAMAGED: sequence %u: damaged packet\n\n", cur_seq);
+                            // Parity may yet rebuild it without asking again
+                            if (!fec) {
+                                reply_seq = cur_seq;
+                                send_nak = true;
+                            }
                         }
-                        else
-                        {
-                            fclose(outfile);
-                            exp_seq = (exp_seq + 1) % SEQ_NUM;
-                            std::cout << "RECEIVED: close packet for file transfer: closing transfer" 
-                                << std::endl << std::endl;
-                            running = false;
+                        else if (offset == 0) {
+                            if (fec && data_size <= request.payload_size) {
+                                held[cur_seq & (slots - 1)].copy_from(packet);
+                                try_repair = true;
+                            }
+                            running = deliver_packet(packet, delivery);
+                            exp_seq++;
+                            // Only a packet that leaves nothing held may have its
+                            // ACK put off; filling a hole is reported at once
+                            in_order = (int32_t)(highest - exp_seq) <= 0;
+                            // Hand over anything held that is now in order
+                            while (running && have[exp_seq & (slots - 1)]) {
+                                have[exp_seq & (slots - 1)] = false;
+                                running = deliver_packet(held[exp_seq & (slots - 1)], delivery);
+                                exp_seq++;
+                            }
+                            if ((int32_t)(highest - exp_seq) < 0)
+                                highest = exp_seq;
+                            sack_stale = true;
                             send_ack = true;
-                            break;
                         }
-                        send_ack = true;
+                        else if (offset < reply.window && data_size <= request.payload_size) {
+                            if (!have[cur_seq & (slots - 1)]) {
+                                LOG(LOG_DEBUG, "BUFFERED: sequence %u: out of order\n\n", cur_seq);
+                                held[cur_seq & (slots - 1)].copy_from(packet);
+                                have[cur_seq & (slots - 1)] = true;
+
+                                // Arrivals in order past a hole only grow the last block
+                                if (reply.sack_count > 0 && reply.sack[reply.sack_count - 1].end == cur_seq)
+                                    reply.sack[reply.sack_count - 1].end++;
+                                else
+                                    sack_stale = true;
+                                if (offset >= highest - exp_seq)
+                                    highest = cur_seq + 1;
+                            }
+                            try_repair = fec;
+                            send_ack = true;
+                        }
+                        else if (exp_seq - cur_seq <= reply.window) {
+                            // Already delivered, so our earlier ACK must have been lost
+                            send_ack = true;
+                        }
+                        break;
+                    }
+                    if(exp_seq == cur_seq) {
+                        if(packet.verify()) {
+                            running = deliver_packet(packet, delivery);
+                            //Updating the expected sequence number.
+                            exp_seq++;
+                            send_ack = true;
+                            in_order = true;
+                        }
+                        else {
+                            LOG(LOG_DEBUG, "DAMAGED: sequence %u: damaged packet\n\n", cur_seq);
+                            send_nak = true;
+                        }
                     }
                     else {
-                        std::cout << "DAMAGED: sequence " << (int)cur_seq << ": damaged packet"
-                            << std::endl << std::endl;
-                        send_nak = true;
+                        LOG(LOG_DEBUG, "OUT OF ORDER: sequence %u: incorrect sequence number\n\n", cur_seq);
+                        send_ack = true;
                     }
+                break;
+                case PAR:
+                    // Only a client that asked for parity gets any
+                    if (!fec || !informed || packet.version() != PROTOCOL_VERSION || !packet.verify()
+                        || !repair.store(packet)) {
+                        LOG(LOG_DEBUG, "PARITY: Packet discarded\n\n");
+                        break;
+                    }
+                    try_repair = true;
+                break;
+                default:
+                    LOG(LOG_WARN, "UNKNOWN PACKET TYPE: Packet discarded\n\n");
+                break;
+            }
+
+            // Parity and the rest of its group may fill in holes, which
+            // lets everything held behind them through at once
+            size_t count = try_repair && running ? repair.recover(repair.group_start(cur_seq), held, rebuilt) : 0;
+            for (size_t k = 0; k < count; ++k) {
+                uint32_t offset = rebuilt[k] - exp_seq;
+                if (offset >= reply.window)
+                    continue;
+                LOG(LOG_DEBUG, "REBUILT: sequence %u from parity\n\n", rebuilt[k]);
+                have[rebuilt[k] & (slots - 1)] = true;
+                if (offset >= highest - exp_seq)
+                    highest = rebuilt[k] + 1;
+                repaired++;
+            }
+            if (count > 0) {
+                while (running && have[exp_seq & (slots - 1)]) {
+                    have[exp_seq & (slots - 1)] = false;
+                    running = deliver_packet(held[exp_seq & (slots - 1)], delivery);
+                    exp_seq++;
                 }
-                else {
-                    std::cout << "OUT OF ORDER: sequence " << (int)cur_seq << ": incorrect sequence number" 
-                        << std::endl << std::endl;
-                    send_ack = true;
+                if ((int32_t)(highest - exp_seq) < 0)
+                    highest = exp_seq;
+                in_order = false;
+                sack_stale = true;
+                send_ack = true;
+            }
+
+            // A group its parity cannot cover is asked for again at once, as
+            // it may have more holes than SACK blocks can show. Go-Back-N
+            // goes back to its base on any NAK, so one is enough.
+            size_t lost = try_repair && packet_type == PAR && running && count == 0
+                ? repair.unrepairable(cur_seq, held, unrepaired) : 0;
+            for (size_t k = 0; k < lost; ++k) {
+                if (unrepaired[k] - exp_seq >= reply.window)
+                    continue;
+                LOG(LOG_DEBUG, "UNREPAIRABLE: sequence %u: asking for it again\n\n", unrepaired[k]);
+                Ack nak = reply;
+                nak.sequence = unrepaired[k];
+                replies.next().set_checksum_type(request.checksum);
+                build_ack(replies.next(), nak, NAK);
+                replies.push(server);
+                if (request.mode == MODE_GO_BACK_N)
+                    break;
+            }
+
+            // A hole at the base that neither parity nor a resend has filled
+            // after two groups' worth of packets was most likely lost again
+            // on its way back, and no parity covers a resend, so it is asked
+            // for once more rather than left to the server's timer
+            if (fec && running && (packet_type == TRN || packet_type == PAR)) {
+                if (stalled_seq != exp_seq) {
+                    stalled_seq = exp_seq;
+                    stalled = 0;
                 }
-            break;
-            default:
-                printf("UNKNOWN PACKET TYPE: Packet discarded");
-            break;
-        }
+                else if (++stalled >= (size_t)(request.fec_group + request.fec_parity)) {
+                    LOG(LOG_DEBUG, "STALLED: sequence %u: asking for it again\n\n", exp_seq);
+                    Ack nak = reply;
+                    nak.sequence = exp_seq;
+                    replies.next().set_checksum_type(request.checksum);
+                    build_ack(replies.next(), nak, NAK);
+                    replies.push(server);
+                    stalled = 0;
+                }
+            }
 
-        // Send ACK for received packet
-        if(send_ack) {
-            packet = Packet(exp_seq, ACK);
-            std::cout << "SENDING ACK: sequence " << (int)exp_seq << std::endl << std::endl;
-        
-            if (sendto(sockfd, packet.buffer, PACKET_SIZE, 0, (struct sockaddr*) &server, slen) == -1)
-            {
-                perror("Error: could not send acknowledge to server\n");
-                close(sockfd);
-                exit(EXIT_FAILURE);
+            if (reply_seq == -1)
+                reply_seq = exp_seq;
+            reply.sequence = reply_seq;
+            if (sack_stale) {
+                collect_sack(reply, have, exp_seq, highest);
+                sack_stale = false;
             }
-        }
-        // Send NAK for damaged packet
-        else if (send_nak) {
-            packet = Packet(exp_seq, NAK);            
-            std::cout << "SENDING NAK: sequence " << (int)exp_seq << std::endl << std::endl;
-        
-            if (sendto(sockfd, packet.buffer, PACKET_SIZE, 0, (struct sockaddr*) &server, slen) == -1)
-            {
-                perror("Error: could not send acknowledge to server\n");
-                close(sockfd);
-                exit(EXIT_FAILURE);
+
+            // Put off the ACK for a run of in-order packets; anything else
+            // (gaps, duplicates, damage, the end of the file) is answered at
+            // once and covers whatever was put off
+            if (send_ack && in_order && running && ++unacked < policy.every) {
+                if (unacked == 1)
+                    ack_timer.start();
+                continue;
             }
-        }
+            if (send_ack || send_nak)
+                unacked = 0;
+
+            replies.next().set_checksum_type(request.checksum);
 
+            // Send ACK for received packet
+            if(send_ack) {
+                build_ack(replies.next(), reply, ACK);
+                LOG(LOG_DEBUG, "SENDING ACK: sequence %u\n\n", reply_seq);
+                replies.push(server);
+            }
+            // Send NAK for damaged packet
+            else if (send_nak) {
+                build_ack(replies.next(), reply, NAK);
+                LOG(LOG_DEBUG, "SENDING NAK: sequence %u\n\n", reply_seq);
+                replies.push(server);
+            }
+        }
+        replies.flush();
     }
-    // Sending success message for completion
-    char* msg = SUCCESS_MSG;
-    std::string ttemp(SUCCESS_MSG);
-    packet = Packet(msg, ttemp.size(), 0, GET);
-    std::cout << "SENDING SUCCESS MSG" << std::endl;
-    if (sendto(sockfd, packet.buffer, PACKET_SIZE, 0, (struct sockaddr*) &server, slen) == -1)
+
+    if (delivery.compressed > 0)
+        LOG(LOG_INFO, "%u of %u packets arrived compressed\n", delivery.compressed, delivery.delivered);
+    if (repaired > 0)
+        LOG(LOG_INFO, "%u packets rebuilt from parity\n", repaired);
+    writer.flush(delivery.stream);
+}
+
+// Tells the server the file has arrived
+void send_success(int sockfd, sockaddr_in server)
+{
+    socklen_t slen = sizeof(server);
+    char msg[] = SUCCESS_MSG;
+    Packet success(msg, strlen(msg), 0, GET);
+    LOG(LOG_INFO, "SENDING SUCCESS MSG\n");
+    if (sendto(sockfd, success.buffer, success.length(), 0, (struct sockaddr*) &server, slen) == -1)
     {
         perror("Error: could not send acknowledge to server\n");
         close(sockfd);
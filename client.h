@@ -1,13 +1,44 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <stdio.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <vector>
 #include "util.h"
+#include "writer.h"
+#include "timers.h"
 
-std::string packet_string(Packet& packet);
-std::string packet_string(Packet& packet, size_t size);
-void request_func(int sockfd, char* filename, size_t length, sockaddr_in server);
-void receive_func(int sockfd, char* filename, sockaddr_in server);
+/// When the client acknowledges in-order data: after every packets, or
+/// once the first unacknowledged one has waited delay_nsec.
+struct AckPolicy
+{
+	int every;
+	nano_t delay_nsec;
+};
+
+/// Where one stream's in-order payloads go: the stream's own cursor into
+/// the shared output file, and how many payloads it has delivered so far.
+/// Compressed payloads are expanded into a buffer of their own first.
+struct Delivery
+{
+	FileWriter* writer;
+	FileWriter::Stream stream;
+	Request* request;
+	uint64_t delivered;
+	uint64_t compressed;
+	std::vector<char> expanded;
+};
+
+int open_client_socket(unsigned short port, Request& request);
+void receive_stream(int sockfd, Request& request, sockaddr_in server, AckPolicy& policy, FileWriter& writer);
+void request_func(int sockfd, Request& request, sockaddr_in server);
+uint16_t receive_window(int sockfd, Request& request);
+void collect_sack(Ack& ack, std::vector<bool>& have, uint32_t exp_seq, uint32_t highest);
+bool deliver_packet(Packet& packet, Delivery& delivery);
+bool wait_readable(int sockfd, nano_t timeout_nsec);
+void receive_func(int sockfd, Request& request, sockaddr_in server, AckPolicy& policy, FileWriter& writer);
+void send_success(int sockfd, sockaddr_in server);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,209 @@
+/// @file compress.cpp
+///
+/// A small, fast LZ77 codec for packet payloads. It is greedy and keeps one
+/// candidate per hash bucket, trading ratio for speed in the way LZ4 does,
+/// so that compressing a packet costs less than sending it.
+
+#include <string.h>
+
+#include "compress.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_HASH_BITS 12
+#define LZ_MIN_HASH_BITS 8
+// The format ends every block with at least this many literals, and starts
+// no match this close to the end
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+// Misses in a row before the search starts skipping ahead faster
+#define LZ_SKIP_TRIGGER 6
+
+static inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t lz_hash(uint32_t value, int bits)
+{
+	return (value * 2654435761u) >> (32 - bits);
+}
+
+// Writes the part of a length that did not fit in its token nibble
+static bool put_length(uint8_t*& out, uint8_t* end, size_t length)
+{
+	for (; length >= 255; length -= 255)
+	{
+		if (out >= end)
+			return false;
+		*out++ = 255;
+	}
+	if (out >= end)
+		return false;
+	*out++ = (uint8_t)length;
+	return true;
+}
+
+// Writes one sequence: literals from anchor, then a match of match_length
+// bytes offset back, or no match at all when match_length is zero
+static bool put_sequence(uint8_t*& out, uint8_t* end, const uint8_t* anchor, size_t literals, size_t offset,
+	size_t match_length)
+{
+	if (out >= end)
+		return false;
+	uint8_t* token = out++;
+	*token = (uint8_t)((literals < 15 ? literals : 15) << 4);
+	if (literals >= 15 && !put_length(out, end, literals - 15))
+		return false;
+	if ((size_t)(end - out) < literals)
+		return false;
+	memcpy(out, anchor, literals);
+	out += literals;
+
+	if (match_length == 0)
+		return true;
+	if (end - out < 2)
+		return false;
+	*out++ = (uint8_t)offset;
+	*out++ = (uint8_t)(offset >> 8);
+	size_t extra = match_length - LZ_MIN_MATCH;
+	*token |= (uint8_t)(extra < 15 ? extra : 15);
+	return extra < 15 || put_length(out, end, extra - 15);
+}
+
+size_t lz_compress(const char* source, size_t length, char* dest, size_t capacity)
+{
+	const uint8_t* const start = (const uint8_t*)source;
+	const uint8_t* const in_end = start + length;
+	const uint8_t* anchor = start;
+	uint8_t* out = (uint8_t*)dest;
+	uint8_t* const out_end = out + capacity;
+
+	if (length > LZ_MATCH_LIMIT)
+	{
+		// A smaller input gets a smaller table, which is cheaper to clear
+		int bits = LZ_MIN_HASH_BITS;
+		while (bits < LZ_MAX_HASH_BITS && ((size_t)1 << bits) < length)
+			bits++;
+		uint16_t table[1 << LZ_MAX_HASH_BITS];
+		memset(table, 0, sizeof(uint16_t) << bits);
+
+		const uint8_t* const match_start_limit = in_end - LZ_MATCH_LIMIT;
+		const uint8_t* const match_end_limit = in_end - LZ_LAST_LITERALS;
+		const uint8_t* ip = start + 1;
+		unsigned misses = 0;
+		while (ip < match_start_limit)
+		{
+			uint32_t sequence = read32(ip);
+			uint32_t bucket = lz_hash(sequence, bits);
+			const uint8_t* ref = start + table[bucket];
+			table[bucket] = (uint16_t)(ip - start);
+			if (ref >= ip || read32(ref) != sequence)
+			{
+				ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+				continue;
+			}
+			misses = 0;
+
+			while (ip > anchor && ref > start && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			const uint8_t* match_end = ip + LZ_MIN_MATCH;
+			const uint8_t* ref_end = ref + LZ_MIN_MATCH;
+			while (match_end < match_end_limit && *match_end == *ref_end)
+			{
+				match_end++;
+				ref_end++;
+			}
+
+			if (!put_sequence(out, out_end, anchor, ip - anchor, ip - ref, match_end - ip))
+				return 0;
+			ip = match_end;
+			anchor = ip;
+
+			// Remember a position inside the match too, as the next match is
+			// often a repeat of the same text
+			if (ip - 2 > start && ip < match_start_limit)
+				table[lz_hash(read32(ip - 2), bits)] = (uint16_t)(ip - 2 - start);
+		}
+	}
+
+	if (!put_sequence(out, out_end, anchor, in_end - anchor, 0, 0))
+		return 0;
+	return out - (uint8_t*)dest;
+}
+
+// Reads the part of a length that did not fit in its token nibble
+static bool get_length(const uint8_t*& in, const uint8_t* end, size_t& length)
+{
+	uint8_t byte;
+	do
+	{
+		if (in >= end)
+			return false;
+		byte = *in++;
+		length += byte;
+	}
+	while (byte == 255);
+	return true;
+}
+
+long lz_decompress(const char* source, size_t length, char* dest, size_t capacity)
+{
+	const uint8_t* in = (const uint8_t*)source;
+	const uint8_t* const in_end = in + length;
+	uint8_t* out = (uint8_t*)dest;
+	uint8_t* const out_end = out + capacity;
+
+	while (in < in_end)
+	{
+		uint8_t token = *in++;
+		size_t literals = token >> 4;
+		if (literals == 15 && !get_length(in, in_end, literals))
+			return -1;
+		if (literals > (size_t)(in_end - in) || literals > (size_t)(out_end - out))
+			return -1;
+		memcpy(out, in, literals);
+		in += literals;
+		out += literals;
+
+		// The last sequence is literals alone
+		if (in == in_end)
+			break;
+		if (in_end - in < 2)
+			return -1;
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		if (offset == 0 || offset > (size_t)(out - (uint8_t*)dest))
+			return -1;
+
+		size_t match_length = token & 15;
+		if (match_length == 15 && !get_length(in, in_end, match_length))
+			return -1;
+		match_length += LZ_MIN_MATCH;
+		if (match_length > (size_t)(out_end - out))
+			return -1;
+
+		// A match may overlap the bytes it is producing, repeating them
+		const uint8_t* ref = out - offset;
+		if (offset >= match_length)
+		{
+			memcpy(out, ref, match_length);
+		}
+		else
+		{
+			for (size_t i = 0; i < match_length; ++i)
+				out[i] = ref[i];
+		}
+		out += match_length;
+	}
+	return out - (uint8_t*)dest;
+}
+
+const char* compression_name(uint8_t codec)
+{
+	return codec == COMPRESSION_LZ ? "lz" : "none";
+}
@@ -0,0 +1,26 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Payload codecs a client can ask for. Each packet is compressed on its own,
+// so a lost or reordered packet never holds up decoding the others.
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ 1
+
+/// Compresses length bytes of source into dest in the LZ4 block format: runs
+/// of literals, each followed by a copy of earlier output. Returns the size
+/// of the result, or 0 if it does not fit in capacity bytes, which is how a
+/// caller learns the data is not worth compressing. The input must be
+/// shorter than 64KB.
+size_t lz_compress(const char* source, size_t length, char* dest, size_t capacity);
+
+/// Undoes lz_compress(). Returns the size of the result, or -1 if the input
+/// is malformed or the result would not fit in capacity bytes. Never reads
+/// or writes out of bounds, whatever the input.
+long lz_decompress(const char* source, size_t length, char* dest, size_t capacity);
+
+const char* compression_name(uint8_t codec);
+
+#endif
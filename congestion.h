@@ -0,0 +1,109 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "timers.h"
+
+#define CONGESTION_RENO 0
+#define CONGESTION_VEGAS 1
+
+#define CONGESTION_INITIAL_WINDOW 4
+#define CONGESTION_MIN_SSTHRESH 2
+// Vegas keeps between alpha and beta packets queued in the path
+#define CONGESTION_VEGAS_ALPHA 2
+#define CONGESTION_VEGAS_BETA 4
+
+/// A sender's congestion window, in packets. It opens with slow start, grows
+/// by about one packet per round trip once past ssthresh, halves on a loss
+/// and drops back to one packet on a retransmission timeout. The Vegas
+/// variant also compares each RTT sample against the smallest one seen and
+/// stops growing once packets start queueing in the path.
+struct CongestionControl
+{
+private:
+	int _algorithm;
+	double _cwnd;
+	double _ssthresh;
+	size_t _limit;
+	nano_t _base_rtt;
+
+	void clamp()
+	{
+		if (_cwnd < 1)
+			_cwnd = 1;
+		if (_cwnd > _limit)
+			_cwnd = _limit;
+	}
+
+public:
+	CongestionControl()
+	{
+		reset(CONGESTION_RENO, 1);
+	}
+
+	/// Starts over for a new transfer whose window can never exceed limit.
+	void reset(int algorithm, size_t limit)
+	{
+		_algorithm = algorithm;
+		_limit = limit;
+		_cwnd = CONGESTION_INITIAL_WINDOW < limit ? CONGESTION_INITIAL_WINDOW : limit;
+		_ssthresh = limit;
+		_base_rtt = 0;
+	}
+
+	/// Called when count new packets have been acknowledged. rtt is the
+	/// sample they produced, or 0 if Karn's rule ruled one out.
+	void acked(size_t count, nano_t rtt)
+	{
+		if (_algorithm == CONGESTION_VEGAS && rtt > 0)
+		{
+			if (_base_rtt == 0 || rtt < _base_rtt)
+				_base_rtt = rtt;
+
+			// Packets of ours sitting in queues: cwnd * (1 - base_rtt / rtt)
+			double queued = _cwnd * (double)(rtt - _base_rtt) / rtt;
+			if (_cwnd < _ssthresh && queued > 1)
+				_ssthresh = _cwnd;
+			if (_cwnd >= _ssthresh)
+			{
+				if (queued > CONGESTION_VEGAS_BETA)
+					_cwnd -= count / _cwnd;
+				else if (queued < CONGESTION_VEGAS_ALPHA)
+					_cwnd += count / _cwnd;
+				clamp();
+				return;
+			}
+		}
+
+		if (_cwnd < _ssthresh)
+			_cwnd += count;
+		else
+			_cwnd += count / _cwnd;
+		clamp();
+	}
+
+	/// Called once per window in which a loss or NAK was detected.
+	void loss()
+	{
+		_ssthresh = _cwnd / 2;
+		if (_ssthresh < CONGESTION_MIN_SSTHRESH)
+			_ssthresh = CONGESTION_MIN_SSTHRESH;
+		_cwnd = _ssthresh;
+		clamp();
+	}
+
+	/// Called when the retransmission timer expires.
+	void timeout()
+	{
+		_ssthresh = _cwnd / 2;
+		if (_ssthresh < CONGESTION_MIN_SSTHRESH)
+			_ssthresh = CONGESTION_MIN_SSTHRESH;
+		_cwnd = 1;
+	}
+
+	size_t window() { return (size_t)_cwnd; }
+	size_t ssthresh() { return (size_t)_ssthresh; }
+};
+
+#endif
@@ -0,0 +1,450 @@
+/// @file fec.cpp
+///
+/// Parity packets over groups of data packets: a systematic erasure code
+/// over GF(256), so a client can rebuild lost or damaged packets without a
+/// round trip. Multiplying a buffer by a constant is the only costly step;
+/// it is done with a 64KB product table, or 32 bytes at a time with AVX2
+/// nibble lookups where the CPU has them.
+
+#include <string.h>
+#include <immintrin.h>
+#include <utility>
+
+#include "fec.h"
+
+// The field's reducing polynomial, x^8 + x^4 + x^3 + x^2 + 1
+#define GF_POLY 0x11D
+
+// Products, inverses and the code's coefficients, built once
+struct GaloisTables
+{
+	uint8_t product[256][256];
+	uint8_t inverse[256];
+	uint8_t coefficient[FEC_MAX_PARITY][FEC_MAX_GROUP];
+
+	GaloisTables()
+	{
+		uint8_t exp[510];
+		uint8_t log[256];
+		unsigned x = 1;
+		for (int i = 0; i < 255; ++i)
+		{
+			exp[i] = exp[i + 255] = (uint8_t)x;
+			log[x] = (uint8_t)i;
+			x <<= 1;
+			if (x & 0x100)
+				x ^= GF_POLY;
+		}
+
+		for (int a = 0; a < 256; ++a)
+		{
+			for (int b = 0; b < 256; ++b)
+				product[a][b] = a && b ? exp[log[a] + log[b]] : 0;
+			inverse[a] = a ? exp[255 - log[a]] : 0;
+		}
+
+		// Row r and column c of the Cauchy matrix are 1 / (x_r + y_c), with
+		// x_r = r and y_c = FEC_MAX_PARITY + c all distinct. Scaling column c
+		// by x_0 + y_c = y_c turns row 0 into ones.
+		for (int row = 0; row < FEC_MAX_PARITY; ++row)
+		{
+			for (int column = 0; column < FEC_MAX_GROUP; ++column)
+			{
+				uint8_t y = (uint8_t)(FEC_MAX_PARITY + column);
+				coefficient[row][column] = product[y][inverse[row ^ y]];
+			}
+		}
+	}
+};
+
+static GaloisTables& galois()
+{
+	static GaloisTables tables;
+	return tables;
+}
+
+uint8_t fec_coefficient(size_t row, size_t column)
+{
+	return galois().coefficient[row][column];
+}
+
+// Adding in GF(256) is XOR, which is all a coefficient of one needs
+static void xor_into(uint8_t* dest, const uint8_t* source, size_t length)
+{
+	for (; length >= 8; dest += 8, source += 8, length -= 8)
+	{
+		uint64_t a;
+		uint64_t b;
+		memcpy(&a, dest, sizeof(a));
+		memcpy(&b, source, sizeof(b));
+		a ^= b;
+		memcpy(dest, &a, sizeof(a));
+	}
+	for (; length > 0; ++dest, ++source, --length)
+		*dest ^= *source;
+}
+
+static void multiply_add_table(uint8_t* dest, const uint8_t* source, size_t length, uint8_t coefficient)
+{
+	const uint8_t* product = galois().product[coefficient];
+	for (size_t i = 0; i < length; ++i)
+		dest[i] ^= product[source[i]];
+}
+
+// Multiplying is linear, so a byte's product is the XOR of the products of
+// its two nibbles, each a 16 entry lookup that a byte shuffle does 32 at once
+__attribute__((target("avx2")))
+static void multiply_add_avx2(uint8_t* dest, const uint8_t* source, size_t length, uint8_t coefficient)
+{
+	const uint8_t* product = galois().product[coefficient];
+	uint8_t low[16];
+	uint8_t high[16];
+	for (int i = 0; i < 16; ++i)
+	{
+		low[i] = product[i];
+		high[i] = product[i << 4];
+	}
+	const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low));
+	const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high));
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+	for (; length >= 32; dest += 32, source += 32, length -= 32)
+	{
+		__m256i bytes = _mm256_loadu_si256((const __m256i*)source);
+		__m256i low_product = _mm256_shuffle_epi8(low_table, _mm256_and_si256(bytes, nibble));
+		__m256i high_product = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi64(bytes, 4), nibble));
+		__m256i sum = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)dest),
+			_mm256_xor_si256(low_product, high_product));
+		_mm256_storeu_si256((__m256i*)dest, sum);
+	}
+	multiply_add_table(dest, source, length, coefficient);
+}
+
+// The multiply-add this CPU runs fastest
+struct MultiplyAddDispatch
+{
+	void (*function)(uint8_t* dest, const uint8_t* source, size_t length, uint8_t coefficient);
+
+	MultiplyAddDispatch()
+	{
+		__builtin_cpu_init();
+		function = __builtin_cpu_supports("avx2") ? multiply_add_avx2 : multiply_add_table;
+	}
+};
+
+void gf_multiply_add(char* dest, const char* source, size_t length, uint8_t coefficient)
+{
+	static MultiplyAddDispatch dispatch;
+	if (coefficient == 0)
+		return;
+	if (coefficient == 1)
+		xor_into((uint8_t*)dest, (const uint8_t*)source, length);
+	else
+		dispatch.function((uint8_t*)dest, (const uint8_t*)source, length, coefficient);
+}
+
+// Adds a data packet's symbol, times coefficient, into the symbol at dest
+static void add_symbol(char* dest, Packet& packet, uint8_t coefficient)
+{
+	uint16_t size = packet.size();
+	char header[FEC_SYMBOL_HEADER] = { (char)(size & 0xFF), (char)(size >> 8), (char)packet.flags() };
+	gf_multiply_add(dest, header, FEC_SYMBOL_HEADER, coefficient);
+	gf_multiply_add(dest + FEC_SYMBOL_HEADER, packet.data(), size, coefficient);
+}
+
+// Inverts a size by size matrix in place by Gauss-Jordan elimination.
+// Returns false if it is singular, which no square part of the code's
+// matrix is.
+static bool invert(uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY], size_t size)
+{
+	GaloisTables& gf = galois();
+	uint8_t result[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	for (size_t i = 0; i < size; ++i)
+	{
+		for (size_t j = 0; j < size; ++j)
+			result[i][j] = i == j;
+	}
+
+	for (size_t column = 0; column < size; ++column)
+	{
+		size_t pivot = column;
+		while (pivot < size && matrix[pivot][column] == 0)
+			pivot++;
+		if (pivot == size)
+			return false;
+		for (size_t j = 0; j < size; ++j)
+		{
+			std::swap(matrix[pivot][j], matrix[column][j]);
+			std::swap(result[pivot][j], result[column][j]);
+		}
+
+		uint8_t scale = gf.inverse[matrix[column][column]];
+		for (size_t j = 0; j < size; ++j)
+		{
+			matrix[column][j] = gf.product[scale][matrix[column][j]];
+			result[column][j] = gf.product[scale][result[column][j]];
+		}
+		for (size_t i = 0; i < size; ++i)
+		{
+			uint8_t factor = matrix[i][column];
+			if (i == column || factor == 0)
+				continue;
+			for (size_t j = 0; j < size; ++j)
+			{
+				matrix[i][j] ^= gf.product[factor][matrix[column][j]];
+				result[i][j] ^= gf.product[factor][result[column][j]];
+			}
+		}
+	}
+
+	memcpy(matrix, result, sizeof(result));
+	return true;
+}
+
+void FecEncoder::open(const Request& request, uint8_t version, size_t window)
+{
+	close();
+	if (request.fec_group == 0 || version < 4)
+		return;
+
+	_group = request.fec_group;
+	_parity = request.fec_parity;
+	_groups = window / _group + 2;
+	_sequence_mask = sequence_mask(version);
+	_rows.assign(_groups * _parity, request.payload_size + FEC_OVERHEAD);
+	for (size_t i = 0; i < _rows.size(); ++i)
+	{
+		_rows[i].set_version(version);
+		_rows[i].set_checksum_type(request.checksum);
+		_rows[i].set_flags(0);
+	}
+	_current = _groups - 1;
+	_length = 0;
+	_filled = 0;
+	_sealed = 0;
+}
+
+void FecEncoder::close()
+{
+	_group = 0;
+	_parity = 0;
+	_rows.clear();
+}
+
+bool FecEncoder::add(Packet& packet, size_t index, bool last)
+{
+	GaloisTables& gf = galois();
+	size_t column = index % _group;
+	if (column == 0)
+	{
+		// Only the bytes the slot's last group used need clearing
+		_current = (_current + 1) % _groups;
+		for (size_t row = 0; row < _parity; ++row)
+		{
+			Packet& parity = this->parity(row);
+			if (parity.size() > FEC_PARITY_HEADER)
+				memset(parity.data() + FEC_PARITY_HEADER, 0, parity.size() - FEC_PARITY_HEADER);
+		}
+		_length = 0;
+		_sealed = 0;
+		_start = index;
+	}
+
+	for (size_t row = 0; row < _parity; ++row)
+		add_symbol(parity(row).data() + FEC_PARITY_HEADER, packet, gf.coefficient[row][column]);
+	if (FEC_SYMBOL_HEADER + (size_t)packet.size() > _length)
+		_length = FEC_SYMBOL_HEADER + packet.size();
+	_filled = column + 1;
+
+	if (_filled < _group && !last)
+		return false;
+	return flush();
+}
+
+// The symbols stay where they are, so a group sealed early can go on
+// taking packets
+bool FecEncoder::flush()
+{
+	if (_filled == _sealed)
+		return false;
+	for (size_t row = 0; row < _parity; ++row)
+	{
+		Packet& parity = this->parity(row);
+		parity.data()[0] = (char)row;
+		parity.data()[1] = (char)_filled;
+		parity.seal(FEC_PARITY_HEADER + _length, _start & _sequence_mask, PAR);
+	}
+	_sealed = _filled;
+	return true;
+}
+
+void FecDecoder::open(const Request& request, size_t slots)
+{
+	_group = request.fec_group;
+	_parity = request.fec_parity;
+	_rows.clear();
+	if (_group == 0)
+		return;
+
+	_groups = slots / _group + 2;
+	_payload_size = request.payload_size;
+	_checksum = request.checksum;
+	_rows.assign(_groups * _parity, _payload_size + FEC_OVERHEAD);
+	_work.assign(2 * _parity * (FEC_SYMBOL_HEADER + _payload_size), 0);
+	_reported.assign(_groups, -1);
+}
+
+Packet* FecDecoder::row(uint32_t start, size_t row)
+{
+	Packet& packet = _rows[(start / _group) % _groups * _parity + row];
+	if (packet.type() != PAR || packet.sequence() != start)
+		return NULL;
+	return &packet;
+}
+
+bool FecDecoder::store(Packet& packet)
+{
+	if (packet.size() < FEC_OVERHEAD || packet.size() > FEC_OVERHEAD + _payload_size)
+		return false;
+	uint8_t row = packet.data()[0];
+	uint8_t count = packet.data()[1];
+	uint32_t start = packet.sequence();
+	if (row >= _parity || count == 0 || count > _group || start % _group != 0)
+		return false;
+
+	_rows[(start / _group) % _groups * _parity + row].copy_from(packet);
+	return true;
+}
+
+// Finds the group's newest parity, sealed over the most packets, and the
+// packets it covers that have not arrived
+void FecDecoder::survey(uint32_t start, PacketSlots& held, Survey& group)
+{
+	group.available = 0;
+	group.count = 0;
+	group.lost = 0;
+	for (size_t r = 0; r < _parity; ++r)
+	{
+		Packet* parity = row(start, r);
+		if (parity != NULL && (uint8_t)parity->data()[1] > group.count)
+			group.count = (uint8_t)parity->data()[1];
+	}
+	if (group.count == 0)
+		return;
+
+	// Parity sealed together agrees on its length too
+	group.length = 0;
+	for (size_t r = 0; r < _parity; ++r)
+	{
+		Packet* parity = row(start, r);
+		if (parity == NULL || (uint8_t)parity->data()[1] != group.count)
+			continue;
+		size_t length = parity->size() - FEC_PARITY_HEADER;
+		if (group.available == 0)
+			group.length = length;
+		else if (length != group.length)
+			continue;
+		group.rows[group.available] = parity;
+		group.row_index[group.available++] = r;
+	}
+
+	size_t mask = held.size() - 1;
+	for (size_t column = 0; column < group.count; ++column)
+	{
+		Packet& packet = held[(start + column) & mask];
+		if (packet.type() != TRN || packet.sequence() != start + column)
+			group.missing[group.lost++] = column;
+	}
+}
+
+size_t FecDecoder::recover(uint32_t start, PacketSlots& held, uint32_t* rebuilt)
+{
+	Survey group;
+	survey(start, held, group);
+	if (group.lost == 0 || group.lost > group.available)
+		return 0;
+
+	// Taking what arrived out of the parity leaves the missing packets' part
+	size_t mask = held.size() - 1;
+	GaloisTables& gf = galois();
+	size_t symbol_size = FEC_SYMBOL_HEADER + _payload_size;
+	if (group.length > symbol_size)
+		return 0;
+	for (size_t a = 0; a < group.lost; ++a)
+	{
+		char* syndrome = &_work[a * symbol_size];
+		memcpy(syndrome, group.rows[a]->data() + FEC_PARITY_HEADER, group.length);
+		for (size_t column = 0, next = 0; column < group.count; ++column)
+		{
+			if (next < group.lost && group.missing[next] == column)
+			{
+				next++;
+				continue;
+			}
+			Packet& packet = held[(start + column) & mask];
+			if (FEC_SYMBOL_HEADER + (size_t)packet.size() > group.length)
+				return 0;
+			add_symbol(syndrome, packet, gf.coefficient[group.row_index[a]][column]);
+		}
+	}
+
+	uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	for (size_t a = 0; a < group.lost; ++a)
+	{
+		for (size_t b = 0; b < group.lost; ++b)
+			matrix[a][b] = gf.coefficient[group.row_index[a]][group.missing[b]];
+	}
+	if (!invert(matrix, group.lost))
+		return 0;
+
+	// Solve for every missing symbol before writing any, so a group that does
+	// not add up leaves held as it was
+	for (size_t b = 0; b < group.lost; ++b)
+	{
+		char* symbol = &_work[(_parity + b) * symbol_size];
+		memset(symbol, 0, group.length);
+		for (size_t a = 0; a < group.lost; ++a)
+			gf_multiply_add(symbol, &_work[a * symbol_size], group.length, matrix[b][a]);
+		size_t size = (uint8_t)symbol[0] | ((uint8_t)symbol[1] << 8);
+		if (FEC_SYMBOL_HEADER + size > group.length)
+			return 0;
+	}
+
+	for (size_t b = 0; b < group.lost; ++b)
+	{
+		char* symbol = &_work[(_parity + b) * symbol_size];
+		uint16_t size = (uint8_t)symbol[0] | ((uint8_t)symbol[1] << 8);
+		uint32_t sequence = start + group.missing[b];
+		Packet& packet = held[sequence & mask];
+		packet.set_version(PROTOCOL_VERSION);
+		packet.set_checksum_type(_checksum);
+		packet.set_flags((uint8_t)symbol[2]);
+		memcpy(packet.data(), symbol + FEC_SYMBOL_HEADER, size);
+		packet.seal(size, sequence, TRN);
+		rebuilt[b] = sequence;
+	}
+	return group.lost;
+}
+
+size_t FecDecoder::unrepairable(uint32_t start, PacketSlots& held, uint32_t* lost)
+{
+	Survey group;
+	survey(start, held, group);
+	if (group.lost <= group.available)
+		return 0;
+
+	// Until the group's last parity packet is in, the rest may be on the way
+	if (group.lost <= _parity && group.row_index[group.available - 1] != _parity - 1)
+		return 0;
+
+	// Each sealing of a group is only reported once
+	int64_t& reported = _reported[(start / _group) % _groups];
+	int64_t seal = ((int64_t)start << 8) | group.count;
+	if (reported == seal)
+		return 0;
+	reported = seal;
+
+	for (size_t i = 0; i < group.lost; ++i)
+		lost[i] = start + group.missing[i];
+	return group.lost;
+}
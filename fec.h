@@ -0,0 +1,148 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "util.h"
+
+// A client may ask for up to FEC_MAX_PARITY parity packets for every group
+// of up to FEC_MAX_GROUP data packets
+#define FEC_MAX_GROUP 128
+#define FEC_MAX_PARITY 16
+
+// A parity packet's payload starts with its row in the group's code and the
+// number of data packets in the group, which is short at the end of a file.
+// Each data packet enters the code as its size and flags followed by its
+// payload, so a rebuilt packet comes back exactly as it was sent.
+#define FEC_PARITY_HEADER 2
+#define FEC_SYMBOL_HEADER 3
+#define FEC_OVERHEAD (FEC_PARITY_HEADER + FEC_SYMBOL_HEADER)
+
+/// Adds coefficient times length bytes of source into dest, in GF(256),
+/// using the fastest implementation the CPU supports.
+void gf_multiply_add(char* dest, const char* source, size_t length, uint8_t coefficient);
+
+/// What data packet column of a group is multiplied by in parity row row.
+/// The rows come from a Cauchy matrix, so any square part of it can be
+/// inverted and K parity packets rebuild any K lost data packets. Its
+/// columns are scaled to make row 0 all ones, so a single parity packet is
+/// a plain XOR of its group.
+uint8_t fec_coefficient(size_t row, size_t column);
+
+/// Builds the parity packets for a transfer as its data packets are first
+/// sent. A window's worth of groups is kept, so the parity packets of a
+/// group stay intact after it is done for as long as a window of new data
+/// takes to send, and may be queued by reference.
+class FecEncoder
+{
+private:
+	size_t _group;
+	size_t _parity;
+	size_t _groups;
+	uint32_t _sequence_mask;
+	PacketSlots _rows;
+	size_t _current;
+	size_t _length;
+	size_t _start;
+	size_t _filled;
+	size_t _sealed;
+
+	FecEncoder(const FecEncoder&);
+	FecEncoder& operator=(const FecEncoder&);
+
+public:
+	FecEncoder()
+		: _group(0), _parity(0), _groups(0), _sequence_mask(0), _current(0), _length(0), _start(0), _filled(0),
+		  _sealed(0)
+	{
+	}
+
+	/// Sets up for the request's groups of packets stamped with the given
+	/// version, sent a window at a time, or turns parity off if the request
+	/// asks for none.
+	void open(const Request& request, uint8_t version, size_t window);
+	void close();
+
+	bool enabled() { return _group > 0; }
+	size_t group() { return _group; }
+	size_t parity_count() { return _parity; }
+
+	/// Folds in the data packet at index. Packets must come in order, each
+	/// once. Returns true once the packet completes its group, which the
+	/// last packet of the transfer always does.
+	bool add(Packet& packet, size_t index, bool last);
+
+	/// Seals parity over the part of the current group added so far, for a
+	/// sender that cannot send the rest of it yet. The group carries on and
+	/// is sealed again when complete. Returns false if nothing was added
+	/// since the group was last sealed.
+	bool flush();
+
+	/// A parity packet of the group last sealed, ready to send.
+	Packet& parity(size_t row) { return _rows[_current * _parity + row]; }
+};
+
+/// Keeps the parity packets a client receives and rebuilds lost data packets
+/// from them. Received data packets are looked up in the client's own ring
+/// of them, slot sequence % slots, which must keep a group's packets until
+/// the group is done with.
+class FecDecoder
+{
+private:
+	size_t _group;
+	size_t _parity;
+	size_t _groups;
+	size_t _payload_size;
+	uint8_t _checksum;
+	PacketSlots _rows;
+	std::vector<char> _work;
+	std::vector<int64_t> _reported;
+
+	// What is known of one group
+	struct Survey
+	{
+		Packet* rows[FEC_MAX_PARITY];
+		size_t row_index[FEC_MAX_PARITY];
+		size_t available;
+		size_t count;
+		size_t length;
+		size_t missing[FEC_MAX_GROUP];
+		size_t lost;
+	};
+
+	FecDecoder(const FecDecoder&);
+	FecDecoder& operator=(const FecDecoder&);
+
+	Packet* row(uint32_t start, size_t row);
+	void survey(uint32_t start, PacketSlots& held, Survey& group);
+
+public:
+	FecDecoder() : _group(0), _parity(0), _groups(0), _payload_size(0), _checksum(0) {}
+
+	/// Sets up for the groups the request asks for, for a client that holds
+	/// up to slots packets.
+	void open(const Request& request, size_t slots);
+
+	bool enabled() { return _group > 0; }
+
+	/// The sequence number of the first packet of the group holding sequence.
+	uint32_t group_start(uint32_t sequence) { return sequence - sequence % _group; }
+
+	/// Keeps a verified parity packet. Returns false if it is malformed.
+	bool store(Packet& packet);
+
+	/// Rebuilds the packets missing from the group starting at start into
+	/// their slots in held, if enough of its parity has arrived. Returns
+	/// the number rebuilt, with their sequence numbers in rebuilt, which
+	/// must have room for FEC_MAX_PARITY.
+	size_t recover(uint32_t start, PacketSlots& held, uint32_t* rebuilt);
+
+	/// Lists the packets missing from the group starting at start in lost,
+	/// which must have room for FEC_MAX_GROUP, once its parity shows it is
+	/// beyond repair, so the client can ask for them straight away. Each
+	/// group is only listed once. Returns the number listed.
+	size_t unrepairable(uint32_t start, PacketSlots& held, uint32_t* lost);
+};
+
+#endif
@@ -0,0 +1,271 @@
+/// @file log.cpp
+///
+/// Leveled logging that keeps formatting and console I/O off the send and
+/// receive paths. Callers copy a fixed size binary record into a lock-free
+/// ring (Vyukov's bounded queue, so any thread may log) and a background
+/// thread formats and prints them. When the ring is full records are dropped
+/// and counted rather than making the caller wait.
+///
+/// An idle writer sleeps on a condition variable. It says so in a flag
+/// before its last look at the ring, and the first caller to find the flag
+/// set after adding a record clears it and wakes the writer, so callers only
+/// touch the lock when the ring goes from empty to not empty.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+
+struct LogRecord
+{
+	const char* format;
+	uint64_t args[LOG_MAX_ARGS];
+	uint8_t level;
+	uint8_t text_length;
+	char text[LOG_TEXT_SIZE];
+};
+
+struct LogSlot
+{
+	std::atomic<size_t> sequence;
+	LogRecord record;
+};
+
+int log_level = LOG_DEFAULT_LEVEL;
+
+static LogSlot* slots = NULL;
+static std::atomic<size_t> enqueue_position(0);
+static size_t dequeue_position = 0;
+static std::atomic<unsigned long> dropped(0);
+static std::atomic<bool> running(false);
+static std::atomic<bool> sleeping(false);
+static std::mutex wake_lock;
+static std::condition_variable wake;
+static std::thread* writer = NULL;
+
+// Expands the record's format into out, which holds size bytes
+static void format_record(const LogRecord& record, char* out, size_t size)
+{
+	size_t used = 0;
+	int arg = 0;
+	for (const char* f = record.format; *f != '\0' && used + 1 < size; ++f)
+	{
+		if (*f != '%' || f[1] == '\0')
+		{
+			out[used++] = *f;
+			continue;
+		}
+
+		++f;
+		int written = 0;
+		uint64_t value = arg < LOG_MAX_ARGS ? record.args[arg] : 0;
+		switch (*f)
+		{
+			case 'u':
+				written = snprintf(out + used, size - used, "%llu", (unsigned long long)value);
+				arg++;
+			break;
+			case 'd':
+				written = snprintf(out + used, size - used, "%lld", (long long)value);
+				arg++;
+			break;
+			case 'x':
+				written = snprintf(out + used, size - used, "%llx", (unsigned long long)value);
+				arg++;
+			break;
+			case 'S':
+				written = snprintf(out + used, size - used, "%s", (const char*)(uintptr_t)value);
+				arg++;
+			break;
+			case 's':
+				written = snprintf(out + used, size - used, "%.*s", (int)record.text_length, record.text);
+			break;
+			default:
+				out[used] = *f;
+				written = 1;
+			break;
+		}
+		if (written < 0)
+			break;
+		used += (size_t)written < size - used ? (size_t)written : size - used - 1;
+	}
+	out[used] = '\0';
+}
+
+static void print_record(const LogRecord& record)
+{
+	char line[1024];
+	format_record(record, line, sizeof(line));
+	fputs(line, stdout);
+}
+
+static bool ready()
+{
+	return slots[dequeue_position % LOG_RING_SIZE].sequence.load(std::memory_order_acquire) == dequeue_position + 1;
+}
+
+static bool pop(LogRecord& record)
+{
+	LogSlot& slot = slots[dequeue_position % LOG_RING_SIZE];
+	if (!ready())
+		return false;
+
+	record = slot.record;
+	slot.sequence.store(dequeue_position + LOG_RING_SIZE, std::memory_order_release);
+	dequeue_position++;
+	return true;
+}
+
+static void writer_loop()
+{
+	LogRecord record;
+	while (true)
+	{
+		bool printed = false;
+		while (pop(record))
+		{
+			print_record(record);
+			printed = true;
+		}
+
+		unsigned long lost = dropped.exchange(0);
+		if (lost > 0)
+			fprintf(stderr, "LOG: %lu messages dropped\n", lost);
+
+		if (printed)
+			continue;
+		fflush(stdout);
+		if (!running.load())
+			break;
+
+		// Any record added after the flag is set is either seen here or
+		// wakes the writer
+		sleeping.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (ready())
+		{
+			sleeping.store(false);
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(wake_lock);
+		while (sleeping.load() && running.load())
+			wake.wait(guard);
+		sleeping.store(false);
+	}
+}
+
+// Wakes the writer if it went to sleep on an empty ring
+static void wake_writer()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!sleeping.load(std::memory_order_relaxed) || !sleeping.exchange(false))
+		return;
+	std::lock_guard<std::mutex> guard(wake_lock);
+	wake.notify_one();
+}
+
+static void push(int level, const char* format, const char* text, size_t length,
+	uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+{
+	if (length > LOG_TEXT_SIZE)
+		length = LOG_TEXT_SIZE;
+
+	if (slots == NULL)
+	{
+		LogRecord record;
+		record.format = format;
+		record.args[0] = a;
+		record.args[1] = b;
+		record.args[2] = c;
+		record.args[3] = d;
+		record.level = level;
+		record.text_length = length;
+		memcpy(record.text, text, length);
+		print_record(record);
+		return;
+	}
+
+	size_t position = enqueue_position.load(std::memory_order_relaxed);
+	LogSlot* slot;
+	while (true)
+	{
+		slot = &slots[position % LOG_RING_SIZE];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+		if (difference == 0)
+		{
+			if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (difference < 0)
+		{
+			// The writer has fallen a whole ring behind
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else
+		{
+			position = enqueue_position.load(std::memory_order_relaxed);
+		}
+	}
+
+	LogRecord& record = slot->record;
+	record.format = format;
+	record.args[0] = a;
+	record.args[1] = b;
+	record.args[2] = c;
+	record.args[3] = d;
+	record.level = level;
+	record.text_length = length;
+	memcpy(record.text, text, length);
+	slot->sequence.store(position + 1, std::memory_order_release);
+	wake_writer();
+}
+
+void log_write(int level, const char* format, uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+{
+	push(level, format, NULL, 0, a, b, c, d);
+}
+
+void log_write_text(int level, const char* format, const char* text, size_t length,
+	uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+{
+	push(level, format, text, strnlen(text, length < LOG_TEXT_SIZE ? length : LOG_TEXT_SIZE), a, b, c, d);
+}
+
+void log_open(int level)
+{
+	log_level = level;
+	if (slots != NULL)
+		return;
+
+	slots = new LogSlot[LOG_RING_SIZE];
+	for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+
+	running.store(true);
+	writer = new std::thread(writer_loop);
+	atexit(log_close);
+}
+
+void log_close()
+{
+	if (writer == NULL)
+		return;
+
+	running.store(false);
+	{
+		std::lock_guard<std::mutex> guard(wake_lock);
+		wake.notify_one();
+	}
+	writer->join();
+	delete writer;
+	writer = NULL;
+	fflush(stdout);
+}
@@ -0,0 +1,44 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+// Every packet sent or received
+#define LOG_DEBUG 3
+
+#define LOG_DEFAULT_LEVEL LOG_INFO
+#define LOG_RING_SIZE 8192
+#define LOG_TEXT_SIZE 48
+#define LOG_MAX_ARGS 4
+
+extern int log_level;
+
+/// Logs a message if level is enabled. The format is kept by pointer and so
+/// must be a string literal; it understands %u, %d and %x, which take the
+/// numeric arguments in order, %S, which takes an argument that is a pointer
+/// to a string literal, %s for the text of LOG_TEXT, and %%. Nothing
+/// is evaluated when the level is disabled, so a disabled message costs one
+/// comparison.
+#define LOG(level, ...) \
+	do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+
+/// Like LOG, with up to LOG_TEXT_SIZE bytes of text copied into the record
+/// for the format's %s.
+#define LOG_TEXT(level, format, text, length, ...) \
+	do { if ((level) <= log_level) log_write_text((level), (format), (text), (length), ##__VA_ARGS__); } while (0)
+
+/// Starts the background thread that formats and prints log records, and
+/// arranges for it to be drained and stopped at exit. Until it is started,
+/// messages are formatted and printed on the spot.
+void log_open(int level);
+void log_close();
+
+void log_write(int level, const char* format, uint64_t a = 0, uint64_t b = 0, uint64_t c = 0, uint64_t d = 0);
+void log_write_text(int level, const char* format, const char* text, size_t length,
+	uint64_t a = 0, uint64_t b = 0, uint64_t c = 0, uint64_t d = 0);
+
+#endif
@@ -0,0 +1,239 @@
+/// @file netio.cpp
+///
+/// Batched datagram I/O so a whole window of packets, or a burst of
+/// acknowledgements, costs one system call instead of one per datagram.
+
+#include <errno.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+
+#include "netio.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+SendBatch::SendBatch(int sockfd)
+	: _sockfd(sockfd), _count(0), _messages(0), _gso(false), _packets(BATCH_SIZE), _addrs(BATCH_SIZE),
+	  _msgs(BATCH_SIZE), _iovs(BATCH_SIZE), _controls(BATCH_SIZE), _calls(0)
+{
+}
+
+bool SendBatch::enable_gso()
+{
+	// Probing with a segment size of zero changes nothing but fails where
+	// the option does not exist
+	int probe = 0;
+	_gso = setsockopt(_sockfd, SOL_UDP, UDP_SEGMENT, (char*)&probe, sizeof(probe)) == 0;
+	return _gso;
+}
+
+// Adds the datagram just put in _iovs[_count] to the last message if it can
+// go out as one more segment of it: same address, no bigger than the
+// segments before it, and the last message not ended by a shorter one
+bool SendBatch::coalesce(const struct sockaddr_in& addr, size_t length)
+{
+	if (!_gso || _messages == 0)
+		return false;
+
+	struct msghdr& last = _msgs[_messages - 1].msg_hdr;
+	struct sockaddr_in& to = _addrs[_messages - 1];
+	if (to.sin_addr.s_addr != addr.sin_addr.s_addr || to.sin_port != addr.sin_port)
+		return false;
+
+	size_t segment = last.msg_iov[0].iov_len;
+	size_t total = 0;
+	for (size_t i = 0; i < last.msg_iovlen; ++i)
+		total += last.msg_iov[i].iov_len;
+	if (length > segment || last.msg_iov[last.msg_iovlen - 1].iov_len != segment
+		|| last.msg_iovlen >= GSO_MAX_SEGMENTS || total + length > MAX_PACKET_SIZE)
+		return false;
+
+	last.msg_iovlen++;
+	return true;
+}
+
+// Sets UDP_SEGMENT on a message of more than one datagram
+void SendBatch::segment(struct mmsghdr& message)
+{
+	struct msghdr& header = message.msg_hdr;
+	if (header.msg_iovlen < 2)
+	{
+		header.msg_control = NULL;
+		header.msg_controllen = 0;
+		return;
+	}
+
+	Control& control = _controls[&message - &_msgs[0]];
+	header.msg_control = control.buffer;
+	header.msg_controllen = sizeof(control.buffer);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	uint16_t size = header.msg_iov[0].iov_len;
+	memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+}
+
+void SendBatch::push(const struct sockaddr_in& addr)
+{
+	push(addr, _packets[_count].length());
+}
+
+void SendBatch::push(const struct sockaddr_in& addr, size_t length)
+{
+	push(addr, _packets[_count].buffer, length);
+}
+
+void SendBatch::push(const struct sockaddr_in& addr, const char* data, size_t length)
+{
+	// Datagrams are queued in order, so a message's segments sit next to
+	// each other in _iovs
+	_iovs[_count].iov_base = (void*)data;
+	_iovs[_count].iov_len = length;
+
+	if (!coalesce(addr, length))
+	{
+		_addrs[_messages] = addr;
+		struct msghdr& header = _msgs[_messages].msg_hdr;
+		bzero(&header, sizeof(header));
+		header.msg_name = &_addrs[_messages];
+		header.msg_namelen = sizeof(struct sockaddr_in);
+		header.msg_iov = &_iovs[_count];
+		header.msg_iovlen = 1;
+		_messages++;
+	}
+
+	_count++;
+	if (_count == BATCH_SIZE)
+		flush();
+}
+
+void SendBatch::flush()
+{
+	if (_gso)
+	{
+		for (int i = 0; i < _messages; ++i)
+			segment(_msgs[i]);
+	}
+
+	int sent = 0;
+	while (sent < _messages)
+	{
+		int result = sendmmsg(_sockfd, &_msgs[sent], _messages - sent, 0);
+		_calls++;
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+			{
+				errno = 0;
+				break;
+			}
+			// A route that cannot segment refuses the whole message; carry
+			// on without offload and let the protocol recover the loss
+			if (_gso && (errno == EIO || errno == EINVAL))
+			{
+				std::cerr << "Warning: segmentation offload failed, turning it off" << std::endl;
+				errno = 0;
+				_gso = false;
+				break;
+			}
+			std::cerr << "Error: could not send packet batch" << std::endl;
+			close(_sockfd);
+			exit(EXIT_FAILURE);
+		}
+		sent += result;
+	}
+	_count = 0;
+	_messages = 0;
+}
+
+RecvBatch::RecvBatch()
+	: _count(0), _packets(BATCH_SIZE), _addrs(BATCH_SIZE), _msgs(BATCH_SIZE),
+	  _iovs(BATCH_SIZE), _controls(BATCH_SIZE), _calls(0)
+{
+	for (int i = 0; i < BATCH_SIZE; ++i)
+	{
+		_iovs[i].iov_base = _packets[i].buffer;
+		_iovs[i].iov_len = MAX_PACKET_SIZE;
+	}
+}
+
+bool RecvBatch::enable_gro(int sockfd)
+{
+	int enable = 1;
+	return setsockopt(sockfd, SOL_UDP, UDP_GRO, (char*)&enable, sizeof(enable)) == 0;
+}
+
+// The size of the datagrams the kernel coalesced into a message, or zero if
+// it holds just one
+size_t RecvBatch::segment_size(struct msghdr& header)
+{
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+		{
+			int size;
+			memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+			return size > 0 ? size : 0;
+		}
+	}
+	return 0;
+}
+
+int RecvBatch::receive(int sockfd, bool wait)
+{
+	for (int i = 0; i < BATCH_SIZE; ++i)
+	{
+		struct msghdr& header = _msgs[i].msg_hdr;
+		bzero(&header, sizeof(header));
+		header.msg_name = &_addrs[i];
+		header.msg_namelen = sizeof(struct sockaddr_in);
+		header.msg_iov = &_iovs[i];
+		header.msg_iovlen = 1;
+		header.msg_control = _controls[i].buffer;
+		header.msg_controllen = sizeof(_controls[i].buffer);
+	}
+
+	int flags = wait ? MSG_WAITFORONE : MSG_DONTWAIT;
+	int result;
+	do
+	{
+		result = recvmmsg(sockfd, &_msgs[0], BATCH_SIZE, flags, NULL);
+		_calls++;
+	}
+	while (result < 0 && errno == EINTR);
+
+	_datagrams.clear();
+	for (int i = 0; i < result; ++i)
+	{
+		size_t length = _msgs[i].msg_len;
+		size_t segment = segment_size(_msgs[i].msg_hdr);
+		if (segment == 0 || segment >= length)
+			segment = length;
+
+		// Each segment is a whole datagram starting at its own offset
+		for (size_t offset = 0; offset < length || offset == 0; offset += segment)
+		{
+			Datagram datagram;
+			datagram.packet = (Packet*)(_packets[i].buffer + offset);
+			datagram.length = length - offset < segment ? length - offset : segment;
+			datagram.message = i;
+			_datagrams.push_back(datagram);
+			if (segment == 0)
+				break;
+		}
+	}
+
+	_count = _datagrams.size();
+	return result < 0 ? result : _count;
+}
@@ -0,0 +1,127 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <vector>
+#include "util.h"
+
+using std::vector;
+
+#define BATCH_SIZE 64
+// Most datagrams one segmentation offload send may carry
+#define GSO_MAX_SEGMENTS 64
+
+/// Collects outgoing datagrams and hands them to the kernel with a single
+/// sendmmsg() call. Each datagram is built in place in the slot returned by
+/// next() and queued with push(), or queued from wherever it already is; a
+/// full batch is flushed automatically.
+///
+/// With segmentation offload on, a run of equal sized datagrams to the same
+/// address goes to the kernel as one message with UDP_SEGMENT set, which the
+/// kernel splits back into datagrams as late as it can.
+class SendBatch
+{
+private:
+	struct Control
+	{
+		char buffer[CMSG_SPACE(sizeof(uint16_t))];
+	};
+
+	int _sockfd;
+	int _count;
+	int _messages;
+	bool _gso;
+	vector<Packet> _packets;
+	vector<struct sockaddr_in> _addrs;
+	vector<struct mmsghdr> _msgs;
+	vector<struct iovec> _iovs;
+	vector<Control> _controls;
+	unsigned long _calls;
+
+	bool coalesce(const struct sockaddr_in& addr, size_t length);
+	void segment(struct mmsghdr& message);
+
+public:
+	SendBatch(int sockfd);
+
+	/// Turns on segmentation offload. Returns false, leaving it off, if the
+	/// kernel does not support it.
+	bool enable_gso();
+
+	/// The slot the next datagram should be written into.
+	Packet& next() { return _packets[_count]; }
+
+	/// Queues the packet in next() for the given address.
+	void push(const struct sockaddr_in& addr);
+
+	/// Queues the first length bytes of next(), for datagrams that need not
+	/// parse as packets (a damaged header says nothing true about length).
+	void push(const struct sockaddr_in& addr, size_t length);
+
+	/// Queues length bytes at data without copying them. They must stay
+	/// intact until the batch is flushed.
+	void push(const struct sockaddr_in& addr, const char* data, size_t length);
+
+	/// Sends everything queued. Datagrams the kernel has no room for are
+	/// dropped, as the protocol already recovers from loss. Exits on any
+	/// other socket error.
+	void flush();
+
+	int pending() { return _count; }
+	unsigned long calls() { return _calls; }
+};
+
+/// Receives up to BATCH_SIZE datagrams with a single recvmmsg() call.
+///
+/// With receive offload on, the kernel may hand over a run of datagrams from
+/// one sender as one buffer; they are split back into datagrams in place, so
+/// a batch can hold more than BATCH_SIZE of them.
+class RecvBatch
+{
+private:
+	struct Control
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+	};
+
+	struct Datagram
+	{
+		Packet* packet;
+		size_t length;
+		int message;
+	};
+
+	int _count;
+	vector<Packet> _packets;
+	vector<struct sockaddr_in> _addrs;
+	vector<struct mmsghdr> _msgs;
+	vector<struct iovec> _iovs;
+	vector<Control> _controls;
+	vector<Datagram> _datagrams;
+	unsigned long _calls;
+
+	size_t segment_size(struct msghdr& header);
+
+public:
+	RecvBatch();
+
+	/// Turns on receive offload for a socket. Returns false, leaving it off,
+	/// if the kernel does not support it.
+	static bool enable_gro(int sockfd);
+
+	/// Reads whatever is waiting on the socket. With wait set the call
+	/// blocks (subject to SO_RCVTIMEO) until at least one datagram arrives.
+	/// Returns the number of datagrams received, or -1 with errno set.
+	int receive(int sockfd, bool wait);
+
+	int count() { return _count; }
+	Packet& packet(int index) { return *_datagrams[index].packet; }
+	struct sockaddr_in& addr(int index) { return _addrs[_datagrams[index].message]; }
+	size_t length(int index) { return _datagrams[index].length; }
+	unsigned long calls() { return _calls; }
+};
+
+#endif
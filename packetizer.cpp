@@ -0,0 +1,259 @@
+/// @file packetizer.cpp
+///
+/// Builds the packets for a file transfer a window at a time, reading each
+/// payload straight into its slot in a small ring with pread().
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <new>
+#include <thread>
+
+#include "compress.h"
+#include "packetizer.h"
+
+#define PACKETIZER_EMPTY ((size_t)-1)
+
+Packetizer::Packetizer()
+	: _fd(-1), _start(0), _end(0), _payload_size(DEFAULT_PAYLOAD_SIZE), _version(PROTOCOL_VERSION),
+	  _checksum(CHECKSUM_CRC32C), _compression(COMPRESSION_NONE),
+	  _count(0), _prefetched(0), _failed(false)
+{
+}
+
+Packetizer::~Packetizer()
+{
+	close();
+}
+
+bool Packetizer::open(const Request& request, uint8_t version, size_t window, PacketCache* cache)
+{
+	close();
+
+	_fd = ::open(request.filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (_fd == -1)
+		return false;
+
+	struct stat info;
+	if (fstat(_fd, &info) == -1)
+	{
+		close();
+		return false;
+	}
+
+	_info.size = info.st_size;
+	_info.mtime_sec = info.st_mtim.tv_sec;
+	_info.mtime_nsec = info.st_mtim.tv_nsec;
+
+	// A range reaching past the end of the file is cut short
+	_end = info.st_size;
+	_start = request.offset < (uint64_t)_end ? (off_t)request.offset : _end;
+	if (request.length > 0 && request.length < (uint64_t)(_end - _start))
+		_end = _start + request.length;
+	_payload_size = request.payload_size;
+	_version = version;
+	_checksum = request.checksum;
+	_compression = version >= 4 ? request.compression : COMPRESSION_NONE;
+	if (_compression != COMPRESSION_NONE)
+		_compressed.resize(_payload_size);
+	_stripe = request;
+	_count = stripe_payloads(_stripe, (_end - _start + _payload_size - 1) / _payload_size) + 1;
+	_failed = false;
+
+	if (cache != NULL)
+	{
+		size_t slot_size = HEADER_SIZE + _payload_size < PACKET_SIZE ? PACKET_SIZE : HEADER_SIZE + _payload_size;
+		if (cache->fits(_count * slot_size) && use_cache(*cache, info))
+			return true;
+	}
+
+	// No point in a ring bigger than the whole transfer
+	size_t slots = window + PACKETIZER_PREFETCH;
+	if (slots > _count)
+		slots = _count;
+	_ring.assign(slots, _payload_size);
+	_ring_index.assign(_ring.size(), PACKETIZER_EMPTY);
+	_prefetched = 0;
+
+	posix_fadvise(_fd, _start, _end - _start, POSIX_FADV_SEQUENTIAL);
+	return true;
+}
+
+void Packetizer::close()
+{
+	if (_fd != -1)
+		::close(_fd);
+	_fd = -1;
+	_count = 0;
+	_ring.clear();
+	_ring_index.clear();
+	_image.reset();
+}
+
+// Takes the transfer's image from the cache, after which the file is not
+// needed, and returns true. Failing that, starts building the image unless
+// another transfer already is, and returns false for this transfer to
+// stream from the file.
+bool Packetizer::use_cache(PacketCache& cache, const struct stat& info)
+{
+	char layout[128];
+	snprintf(layout, sizeof(layout), "%u %u %u %u %u %u %u %lld %lld ",
+		(unsigned)_payload_size, (unsigned)_version, (unsigned)_checksum, (unsigned)_compression,
+		(unsigned)_stripe.stripes, (unsigned)_stripe.stripe, (unsigned)_stripe.stripe_block,
+		(long long)_start, (long long)_end);
+	std::string key = std::string(layout) + _stripe.filename;
+
+	_image = cache.find(key, info);
+	if (!_image)
+	{
+		if (cache.claim(key))
+			std::thread(build, &cache, key, _stripe, _version).detach();
+		return false;
+	}
+
+	::close(_fd);
+	_fd = -1;
+	return true;
+}
+
+// Reads and seals every packet of a transfer into a new image and stores it
+// in the cache, on a thread of its own. The file is opened afresh, and the
+// image records the size and modification time it had then. Whatever goes
+// wrong, the claim on the key is given up, and a build that runs out of
+// memory only loses the image rather than taking the server down with it.
+void Packetizer::build(PacketCache* cache, std::string key, Request request, uint8_t version)
+{
+	std::shared_ptr<PacketImage> image;
+	try
+	{
+		Packetizer source;
+		struct stat info;
+		if (source.open(request, version, 0) && fstat(source._fd, &info) == 0)
+		{
+			image.reset(new PacketImage);
+			image->packets.assign(source._count, source._payload_size);
+			image->bytes = image->packets.bytes();
+			image->file_size = info.st_size;
+			image->file_mtime = info.st_mtim;
+			for (size_t i = 0; image && i < source._count; ++i)
+			{
+				if (!source.read(image->packets[i], i))
+					image.reset();
+			}
+		}
+	}
+	catch (std::bad_alloc&)
+	{
+		std::cerr << "Warning: Not enough memory to cache " << request.filename << std::endl;
+		image.reset();
+	}
+	cache->insert(key, image);
+}
+
+// Reads and seals the packet at index into the given slot
+bool Packetizer::read(Packet& packet, size_t index)
+{
+	packet.set_version(_version);
+	packet.set_checksum_type(_checksum);
+	packet.set_flags(0);
+
+	// The empty final packet lies past the end of the stripe
+	off_t offset = _end;
+	if (index + 1 < _count)
+		offset = _start + (off_t)stripe_payload(_stripe, index) * _payload_size;
+	size_t length = 0;
+	if (offset < _end)
+	{
+		length = _end - offset;
+		if (length > _payload_size)
+			length = _payload_size;
+	}
+
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t numread = pread(_fd, packet.data() + done, length - done, offset + done);
+		if (numread < 0 && errno == EINTR)
+			continue;
+		if (numread <= 0)
+		{
+			std::cerr << "Error: Could not properly read file at offset " << offset << std::endl;
+			_failed = true;
+			return false;
+		}
+		done += numread;
+	}
+
+	// Version 1 peers get padded datagrams, so keep the padding zeroed
+	if (_version < 2)
+		bzero(packet.data() + length, DEFAULT_PAYLOAD_SIZE - length);
+	if (_compression != COMPRESSION_NONE && length > 0)
+		length = compress(packet, length);
+	packet.seal(length, index & sequence_mask(_version), TRN);
+	return true;
+}
+
+// Replaces the payload with its compressed form if that is any smaller, and
+// returns the size of the payload to send
+size_t Packetizer::compress(Packet& packet, size_t length)
+{
+	size_t compressed = lz_compress(packet.data(), length, _compressed.data(), length - 1);
+	if (compressed == 0)
+		return length;
+
+	memcpy(packet.data(), _compressed.data(), compressed);
+	packet.set_flags(PACKET_FLAG_COMPRESSED);
+	return compressed;
+}
+
+bool Packetizer::load(size_t index)
+{
+	size_t slot = index % _ring.size();
+	if (!read(_ring[slot], index))
+	{
+		_ring_index[slot] = PACKETIZER_EMPTY;
+		return false;
+	}
+	_ring_index[slot] = index;
+	return true;
+}
+
+Packet* Packetizer::get(size_t index)
+{
+	if (index >= _count)
+		return NULL;
+	if (_image)
+		return &_image->packets[index];
+	if (_fd == -1)
+		return NULL;
+
+	size_t slot = index % _ring.size();
+	if (_ring_index[slot] != index && !load(index))
+		return NULL;
+
+	return &_ring[slot];
+}
+
+void Packetizer::prefetch(size_t base)
+{
+	if (_fd == -1)
+		return;
+
+	size_t end = base + _ring.size();
+	if (end > _count)
+		end = _count;
+
+	// Everything from base up to _prefetched is already in the ring, as
+	// nothing at or past the base is ever evicted
+	if (_prefetched < base)
+		_prefetched = base;
+	for (; _prefetched < end; ++_prefetched)
+	{
+		if (_ring_index[_prefetched % _ring.size()] != _prefetched && !load(_prefetched))
+			return;
+	}
+}
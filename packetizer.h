@@ -0,0 +1,88 @@
+#ifndef PACKETIZER_H
+#define PACKETIZER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cache.h"
+#include "util.h"
+
+using std::vector;
+
+#define PACKETIZER_PREFETCH 16
+
+/// Turns a file into TRN packets on demand. Only the packets around the send
+/// window are held, in a fixed ring of window + PACKETIZER_PREFETCH compact
+/// slots, so memory use does not depend on the size of the file. The final
+/// packet is always an empty one that tells the client the file is done.
+/// A ranged transfer only covers its range of the file, and a striped one
+/// only its own stripe's payloads of that, numbered from zero.
+///
+/// Payloads are compressed one packet at a time if the client asked for it,
+/// and sent raw whenever that does not save anything.
+///
+/// A transfer small enough for the PacketCache is instead served whole from
+/// a shared image of all its packets. The transfer that finds no image
+/// streams as usual while a thread of its own builds one for the transfers
+/// after it.
+class Packetizer
+{
+private:
+	int _fd;
+	off_t _start;
+	off_t _end;
+	size_t _payload_size;
+	uint8_t _version;
+	uint8_t _checksum;
+	uint8_t _compression;
+	vector<char> _compressed;
+	Request _stripe;
+	size_t _count;
+	FileInfo _info;
+	PacketSlots _ring;
+	vector<size_t> _ring_index;
+	size_t _prefetched;
+	bool _failed;
+	std::shared_ptr<PacketImage> _image;
+
+	bool read(Packet& packet, size_t index);
+	size_t compress(Packet& packet, size_t length);
+	bool load(size_t index);
+	bool use_cache(PacketCache& cache, const struct stat& info);
+	static void build(PacketCache* cache, std::string key, Request request, uint8_t version);
+
+	// Owns a file descriptor, so it is not copyable
+	Packetizer(const Packetizer&);
+	Packetizer& operator=(const Packetizer&);
+
+public:
+	Packetizer();
+	~Packetizer();
+
+	/// Opens the requested file and sizes the ring for a window of the
+	/// requested payloads, stamped with the given wire format version and the
+	/// requested checksum algorithm. Nothing is read until packets are asked
+	/// for. Returns false if the file cannot be opened.
+	bool open(const Request& request, uint8_t version, size_t window, PacketCache* cache = NULL);
+	void close();
+
+	/// Number of packets in the transfer, including the empty final packet.
+	size_t count() { return _count; }
+	/// The size and modification time the file had when it was opened.
+	const FileInfo& info() { return _info; }
+	bool failed() { return _failed; }
+
+	/// Returns the packet at the given position in the file, reading it in if
+	/// it is not already in the ring, or NULL if the read fails.
+	Packet* get(size_t index);
+
+	/// Reads ahead every packet that fits in the ring from base onwards so the
+	/// send path normally finds its packets already built. Bases must not go
+	/// backwards.
+	void prefetch(size_t base);
+};
+
+#endif
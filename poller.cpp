@@ -0,0 +1,81 @@
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "poller.h"
+
+Poller::Poller() : _epfd(-1), _timerfd(-1)
+{
+}
+
+Poller::~Poller()
+{
+	if (_timerfd != -1)
+		close(_timerfd);
+	if (_epfd != -1)
+		close(_epfd);
+}
+
+bool Poller::open(int sockfd)
+{
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (_epfd == -1)
+		return false;
+
+	_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (_timerfd == -1)
+		return false;
+
+	return add(_timerfd) && add(sockfd);
+}
+
+bool Poller::add(int sockfd)
+{
+	struct epoll_event event;
+	bzero(&event, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = sockfd;
+	return epoll_ctl(_epfd, EPOLL_CTL_ADD, sockfd, &event) != -1;
+}
+
+bool Poller::wait(int64_t timeout_nsec)
+{
+	struct itimerspec spec;
+	bzero(&spec, sizeof(spec));
+
+	if (timeout_nsec == 0)
+		return false;
+	if (timeout_nsec > 0)
+	{
+		spec.it_value.tv_sec = timeout_nsec / 1000000000;
+		spec.it_value.tv_nsec = timeout_nsec % 1000000000;
+	}
+	// A zeroed it_value disarms any deadline left over from the last wait
+	timerfd_settime(_timerfd, 0, &spec, NULL);
+
+	struct epoll_event events[POLLER_MAX_EVENTS];
+	int count;
+	do
+	{
+		count = epoll_wait(_epfd, events, POLLER_MAX_EVENTS, -1);
+	}
+	while (count == -1 && errno == EINTR);
+
+	_ready.clear();
+	for (int i = 0; i < count; ++i)
+	{
+		if (events[i].data.fd != _timerfd)
+		{
+			_ready.push_back(events[i].data.fd);
+		}
+		else
+		{
+			uint64_t expirations;
+			if (read(_timerfd, &expirations, sizeof(expirations)) == -1)
+				errno = 0;
+		}
+	}
+
+	return !_ready.empty();
+}
@@ -0,0 +1,39 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <stdint.h>
+#include <vector>
+
+#define POLL_FOREVER -1
+#define POLLER_MAX_EVENTS 64
+
+/// Sleeps on an epoll instance that watches datagram sockets and a timerfd,
+/// so a loop can block until either a packet arrives or its next deadline
+/// (retransmit, delay or close timer) expires.
+class Poller
+{
+private:
+	int _epfd;
+	int _timerfd;
+	std::vector<int> _ready;
+
+public:
+	Poller();
+	~Poller();
+
+	/// Registers the socket for read readiness. Returns false on failure.
+	bool open(int sockfd);
+
+	/// Watches another socket as well. A socket is forgotten once closed.
+	bool add(int sockfd);
+
+	/// Blocks until the socket is readable or timeout_nsec nanoseconds pass.
+	/// A timeout of POLL_FOREVER waits only on the socket. Returns true when
+	/// the socket has data waiting.
+	bool wait(int64_t timeout_nsec);
+
+	/// The sockets the last wait() found readable.
+	const std::vector<int>& ready() { return _ready; }
+};
+
+#endif
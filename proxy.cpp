@@ -0,0 +1,614 @@
+/// @file proxy.cpp
+///
+/// A UDP impairment proxy to sit between client and server. Each direction
+/// is impaired on its own: seeded loss (independent or bursty), corruption,
+/// duplication, reordering, delay with jitter and a bandwidth cap. The same
+/// seed and the same traffic give the same impairments, so an experiment can
+/// be repeated exactly.
+///
+/// Datagrams that need no holding back are copied straight into the send
+/// batch, so an unimpaired direction costs one copy and no timer work.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+
+#include "log.h"
+#include "poller.h"
+#include "proxy.h"
+
+struct Proxy
+{
+    int sockfd;
+    struct sockaddr_in server_addr;
+    Link* links;
+    Poller poller;
+    SendBatch* outbox;
+    uint32_t next_flow;
+    std::map<uint32_t, Flow> flows;
+    std::map<FlowKey, uint32_t> flow_ids;
+    std::map<int, uint32_t> flow_sockets;
+    vector<vector<char> > buffers;
+    vector<uint32_t> free_buffers;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int)
+{
+    stopping = 1;
+}
+
+static uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// A uniform double in [0, 1) from the link's xorshift64* stream
+static double next_random(Link& link)
+{
+    link.random ^= link.random >> 12;
+    link.random ^= link.random << 25;
+    link.random ^= link.random >> 27;
+    return ((link.random * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool roll(Link& link, double chance)
+{
+    return chance > 0 && next_random(link) < chance;
+}
+
+void impairment_defaults(Impairment& impairment)
+{
+    bzero(&impairment, sizeof(impairment));
+    impairment.bad_loss = 1.0;
+    impairment.reorder_gap_ms = PROXY_DEFAULT_REORDER_GAP_MS;
+    impairment.queue_ms = PROXY_DEFAULT_QUEUE_MS;
+}
+
+static bool parse_percent(const char* value, double& chance)
+{
+    char* end;
+    double percent = strtod(value, &end);
+    if (end == value || *end != '\0' || percent < 0 || percent > 100)
+        return false;
+    chance = percent / 100;
+    return true;
+}
+
+static bool parse_msec(const char* value, unsigned int& msec)
+{
+    char* end;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (end == value || *end != '\0')
+        return false;
+    msec = (unsigned int)parsed;
+    return true;
+}
+
+bool parse_impairment(const char* spec, Impairment& impairment)
+{
+    vector<char> copy(spec, spec + strlen(spec) + 1);
+    char* state;
+    for (char* item = strtok_r(&copy[0], ",", &state); item != NULL; item = strtok_r(NULL, ",", &state))
+    {
+        char* value = strchr(item, '=');
+        if (value == NULL)
+            return false;
+        *value++ = '\0';
+
+        bool valid;
+        if (!strcmp(item, "loss"))
+            valid = parse_percent(value, impairment.loss);
+        else if (!strcmp(item, "bad-loss"))
+            valid = parse_percent(value, impairment.bad_loss);
+        else if (!strcmp(item, "corrupt"))
+            valid = parse_percent(value, impairment.corrupt);
+        else if (!strcmp(item, "duplicate"))
+            valid = parse_percent(value, impairment.duplicate);
+        else if (!strcmp(item, "reorder"))
+            valid = parse_percent(value, impairment.reorder);
+        else if (!strcmp(item, "gap"))
+            valid = parse_msec(value, impairment.reorder_gap_ms);
+        else if (!strcmp(item, "delay"))
+            valid = parse_msec(value, impairment.delay_ms);
+        else if (!strcmp(item, "jitter"))
+            valid = parse_msec(value, impairment.jitter_ms);
+        else if (!strcmp(item, "queue"))
+            valid = parse_msec(value, impairment.queue_ms);
+        else if (!strcmp(item, "rate"))
+        {
+            char* end;
+            impairment.rate_mbps = strtod(value, &end);
+            valid = end != value && *end == '\0' && impairment.rate_mbps >= 0;
+        }
+        else if (!strcmp(item, "burst"))
+        {
+            // burst=P/R: P% chance per datagram of entering the bad state,
+            // R% chance of leaving it
+            char* exit = strchr(value, '/');
+            valid = exit != NULL;
+            if (valid)
+            {
+                *exit++ = '\0';
+                valid = parse_percent(value, impairment.burst_enter) && parse_percent(exit, impairment.burst_exit);
+            }
+        }
+        else
+            valid = false;
+
+        if (!valid)
+            return false;
+    }
+    return true;
+}
+
+void link_reset(Link& link, const Impairment& impairment, uint64_t seed)
+{
+    link.impairment = impairment;
+    link.impaired = impairment.loss > 0 || impairment.burst_enter > 0 || impairment.corrupt > 0
+        || impairment.duplicate > 0 || impairment.reorder > 0 || impairment.delay_ms > 0
+        || impairment.jitter_ms > 0 || impairment.rate_mbps > 0;
+    link.random = splitmix64(seed);
+    if (link.random == 0)
+        link.random = 1;
+    link.bad = false;
+    link.link_free = 0;
+    link.order = 0;
+    link.held = std::priority_queue<HeldDatagram>();
+    bzero(&link.stats, sizeof(link.stats));
+}
+
+static int open_socket(unsigned short port)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == -1)
+        return -1;
+
+    int flags = fcntl(sockfd, F_GETFL);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    int buffer_size = PROXY_SOCKET_BUFFER;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (char*)&buffer_size, sizeof(buffer_size));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, (char*)&buffer_size, sizeof(buffer_size));
+
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// The flow for a client, opening its socket towards the server on first
+// contact. Returns NULL if no socket could be had.
+static Flow* flow_for(Proxy& proxy, const struct sockaddr_in& client_addr, nano_t now)
+{
+    FlowKey key(client_addr.sin_addr.s_addr, client_addr.sin_port);
+    std::map<FlowKey, uint32_t>::iterator found = proxy.flow_ids.find(key);
+    if (found != proxy.flow_ids.end())
+        return &proxy.flows[found->second];
+
+    int sockfd = open_socket(0);
+    if (sockfd == -1 || !proxy.poller.add(sockfd))
+    {
+        if (sockfd != -1)
+            close(sockfd);
+        std::cerr << "Error: Could not open a socket towards the server\n";
+        return NULL;
+    }
+
+    uint32_t id = proxy.next_flow++;
+    Flow& flow = proxy.flows[id];
+    flow.id = id;
+    flow.client_addr = client_addr;
+    flow.sockfd = sockfd;
+    flow.outbox = new SendBatch(sockfd);
+    flow.last_heard = now;
+    proxy.flow_ids[key] = id;
+    proxy.flow_sockets[sockfd] = id;
+
+    LOG_TEXT(LOG_INFO, "New flow %u from %s:%u\n", inet_ntoa(client_addr.sin_addr), LOG_TEXT_SIZE,
+        id, ntohs(client_addr.sin_port));
+    return &flow;
+}
+
+static void close_flow(Proxy& proxy, std::map<uint32_t, Flow>::iterator it)
+{
+    Flow& flow = it->second;
+    close(flow.sockfd);
+    delete flow.outbox;
+    proxy.flow_ids.erase(FlowKey(flow.client_addr.sin_addr.s_addr, flow.client_addr.sin_port));
+    proxy.flow_sockets.erase(flow.sockfd);
+    proxy.flows.erase(it);
+}
+
+// Where a datagram for the given direction is built
+static char* outbox_slot(Proxy& proxy, int direction, Flow& flow)
+{
+    return direction == PROXY_UP ? flow.outbox->next().buffer : proxy.outbox->next().buffer;
+}
+
+static void outbox_push(Proxy& proxy, int direction, Flow& flow, size_t length)
+{
+    if (direction == PROXY_UP)
+        flow.outbox->push(proxy.server_addr, length);
+    else
+        proxy.outbox->push(flow.client_addr, length);
+    proxy.links[direction].stats.forwarded++;
+}
+
+static char* hold(Proxy& proxy, Link& link, nano_t due, size_t length, uint32_t flow)
+{
+    uint32_t buffer;
+    if (proxy.free_buffers.empty())
+    {
+        buffer = proxy.buffers.size();
+        proxy.buffers.push_back(vector<char>());
+    }
+    else
+    {
+        buffer = proxy.free_buffers.back();
+        proxy.free_buffers.pop_back();
+    }
+    proxy.buffers[buffer].resize(length);
+
+    HeldDatagram held;
+    held.due = due;
+    held.order = link.order++;
+    held.buffer = buffer;
+    held.length = length;
+    held.flow = flow;
+    link.held.push(held);
+    return &proxy.buffers[buffer][0];
+}
+
+// Flips one to three random bytes
+static void corrupt(Link& link, char* data, size_t length)
+{
+    int count = 1 + (int)(next_random(link) * 3);
+    for (int i = 0; i < count; ++i)
+    {
+        size_t at = (size_t)(next_random(link) * length);
+        data[at] ^= (char)(1 + (int)(next_random(link) * 255));
+    }
+}
+
+static void impair(Proxy& proxy, int direction, Flow& flow, const char* data, size_t length, nano_t now)
+{
+    Link& link = proxy.links[direction];
+    Impairment& impairment = link.impairment;
+    link.stats.received++;
+
+    if (!link.impaired)
+    {
+        memcpy(outbox_slot(proxy, direction, flow), data, length);
+        outbox_push(proxy, direction, flow, length);
+        return;
+    }
+
+    // The Gilbert-Elliott state moves once per datagram
+    if (impairment.burst_enter > 0)
+        link.bad = link.bad ? !roll(link, impairment.burst_exit) : roll(link, impairment.burst_enter);
+    if (roll(link, link.bad ? impairment.bad_loss : impairment.loss))
+    {
+        link.stats.lost++;
+        return;
+    }
+
+    int copies = 1;
+    if (roll(link, impairment.duplicate))
+    {
+        copies = 2;
+        link.stats.duplicated++;
+    }
+
+    for (int copy = 0; copy < copies; ++copy)
+    {
+        nano_t due = now;
+        if (impairment.rate_mbps > 0)
+        {
+            // Serialize onto the link behind whatever is already queued
+            nano_t start = link.link_free > now ? link.link_free : now;
+            if (start - now > (nano_t)impairment.queue_ms * NANO_PER_MILLI)
+            {
+                link.stats.queue_drops++;
+                continue;
+            }
+            link.link_free = start + (nano_t)(length * 8 * 1000 / impairment.rate_mbps);
+            due = link.link_free;
+        }
+        due += (nano_t)impairment.delay_ms * NANO_PER_MILLI;
+        if (impairment.jitter_ms > 0)
+        {
+            int64_t offset = (int64_t)((next_random(link) * 2 - 1) * impairment.jitter_ms * NANO_PER_MILLI);
+            due = offset < 0 && (nano_t)-offset > due - now ? now : due + offset;
+        }
+        if (roll(link, impairment.reorder))
+        {
+            due += (nano_t)impairment.reorder_gap_ms * NANO_PER_MILLI;
+            link.stats.reordered++;
+        }
+
+        // Only skip the queue if that cannot overtake anything in it
+        bool direct = due <= now && link.held.empty();
+        char* out = direct ? outbox_slot(proxy, direction, flow) : hold(proxy, link, due, length, flow.id);
+        memcpy(out, data, length);
+        if (roll(link, impairment.corrupt))
+        {
+            corrupt(link, out, length);
+            link.stats.corrupted++;
+        }
+        if (direct)
+            outbox_push(proxy, direction, flow, length);
+    }
+}
+
+// Sends every held datagram that is due. A datagram for a flow that has
+// since been closed is dropped.
+static void release(Proxy& proxy, int direction, nano_t now)
+{
+    Link& link = proxy.links[direction];
+    while (!link.held.empty() && link.held.top().due <= now)
+    {
+        HeldDatagram held = link.held.top();
+        link.held.pop();
+
+        std::map<uint32_t, Flow>::iterator found = proxy.flows.find(held.flow);
+        if (found != proxy.flows.end())
+        {
+            memcpy(outbox_slot(proxy, direction, found->second), &proxy.buffers[held.buffer][0], held.length);
+            outbox_push(proxy, direction, found->second, held.length);
+        }
+        proxy.free_buffers.push_back(held.buffer);
+    }
+}
+
+static int64_t next_deadline(Proxy& proxy, nano_t now)
+{
+    int64_t deadline = PROXY_IDLE_NSEC;
+    for (int direction = PROXY_UP; direction <= PROXY_DOWN; ++direction)
+    {
+        Link& link = proxy.links[direction];
+        if (link.held.empty())
+            continue;
+        nano_t due = link.held.top().due;
+        int64_t left = due > now ? (int64_t)(due - now) : 1;
+        if (left < deadline)
+            deadline = left;
+    }
+    return deadline;
+}
+
+// Reads everything waiting on a socket. From the client side each datagram
+// goes up its client's flow; on a flow's socket only the server is heard.
+static void drain(Proxy& proxy, RecvBatch& inbox, int sockfd)
+{
+    Flow* flow = NULL;
+    if (sockfd != proxy.sockfd)
+    {
+        std::map<int, uint32_t>::iterator found = proxy.flow_sockets.find(sockfd);
+        if (found == proxy.flow_sockets.end())
+            return;
+        flow = &proxy.flows[found->second];
+    }
+
+    int received = BATCH_SIZE;
+    while (received == BATCH_SIZE)
+    {
+        received = inbox.receive(sockfd, false);
+        if (received < 0)
+        {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != ECONNREFUSED)
+            {
+                std::cerr << "Error: Could not receive datagrams\n";
+                exit(EXIT_FAILURE);
+            }
+            errno = 0;
+            return;
+        }
+
+        nano_t now = now_nsec();
+        for (int i = 0; i < received; ++i)
+        {
+            if (flow == NULL)
+            {
+                Flow* from = flow_for(proxy, inbox.addr(i), now);
+                if (from == NULL)
+                    continue;
+                from->last_heard = now;
+                impair(proxy, PROXY_UP, *from, inbox.packet(i).buffer, inbox.length(i), now);
+            }
+            else if (inbox.addr(i).sin_addr.s_addr == proxy.server_addr.sin_addr.s_addr
+                && inbox.addr(i).sin_port == proxy.server_addr.sin_port)
+            {
+                impair(proxy, PROXY_DOWN, *flow, inbox.packet(i).buffer, inbox.length(i), now);
+            }
+        }
+    }
+}
+
+void proxy_run(int sockfd, struct sockaddr_in server_addr, Link* links)
+{
+    Proxy proxy;
+    proxy.sockfd = sockfd;
+    proxy.server_addr = server_addr;
+    proxy.links = links;
+    proxy.outbox = new SendBatch(sockfd);
+    proxy.next_flow = 0;
+
+    if (!proxy.poller.open(sockfd))
+    {
+        perror("Error: Could not create event poller\n");
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+
+    RecvBatch inbox;
+    Timer reap_timer;
+    reap_timer.start();
+    while (!stopping)
+    {
+        const vector<int>& ready = proxy.poller.ready();
+        for (size_t i = 0; i < ready.size(); ++i)
+            drain(proxy, inbox, ready[i]);
+
+        nano_t now = now_nsec();
+        release(proxy, PROXY_UP, now);
+        release(proxy, PROXY_DOWN, now);
+
+        proxy.outbox->flush();
+        for (std::map<uint32_t, Flow>::iterator it = proxy.flows.begin(); it != proxy.flows.end(); ++it)
+        {
+            if (it->second.outbox->pending() > 0)
+                it->second.outbox->flush();
+        }
+
+        if (reap_timer.timeout(1000))
+        {
+            std::map<uint32_t, Flow>::iterator it = proxy.flows.begin();
+            while (it != proxy.flows.end())
+            {
+                if (now - it->second.last_heard > (nano_t)PROXY_FLOW_IDLE_MSEC * NANO_PER_MILLI)
+                {
+                    LOG(LOG_INFO, "Flow %u idle: closing\n", it->first);
+                    close_flow(proxy, it++);
+                }
+                else
+                    ++it;
+            }
+            reap_timer.start();
+        }
+
+        proxy.poller.wait(next_deadline(proxy, now));
+    }
+
+    while (!proxy.flows.empty())
+        close_flow(proxy, proxy.flows.begin());
+    delete proxy.outbox;
+}
+
+static void print_stats(const char* name, Link& link)
+{
+    LinkStats& stats = link.stats;
+    LOG_TEXT(LOG_INFO, "%s: received %u, forwarded %u, lost %u, queue drops %u\n", name, LOG_TEXT_SIZE,
+        stats.received, stats.forwarded, stats.lost, stats.queue_drops);
+    LOG_TEXT(LOG_INFO, "%s: corrupted %u, duplicated %u, reordered %u\n", name, LOG_TEXT_SIZE,
+        stats.corrupted, stats.duplicated, stats.reordered);
+}
+
+int main(int argc, char** argv)
+{
+    Impairment impairments[2];
+    impairment_defaults(impairments[PROXY_UP]);
+    impairment_defaults(impairments[PROXY_DOWN]);
+    uint64_t seed = PROXY_DEFAULT_SEED;
+    int level = LOG_DEFAULT_LEVEL;
+
+    int option;
+    while ((option = getopt(argc, argv, "S:a:u:d:vq")) != -1)
+    {
+        switch (option)
+        {
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+            break;
+            case 'a':
+                if (!parse_impairment(optarg, impairments[PROXY_UP]) || !parse_impairment(optarg, impairments[PROXY_DOWN]))
+                    argc = 0;
+            break;
+            case 'u':
+                if (!parse_impairment(optarg, impairments[PROXY_UP]))
+                    argc = 0;
+            break;
+            case 'd':
+                if (!parse_impairment(optarg, impairments[PROXY_DOWN]))
+                    argc = 0;
+            break;
+            case 'v':
+                level++;
+            break;
+            case 'q':
+                level = LOG_WARN;
+            break;
+            default:
+                argc = 0;
+            break;
+        }
+    }
+
+    if (argc - optind != 3)
+    {
+        std::cout << "Usage: " << argv[0] << " [-S seed] [-a spec] [-u spec] [-d spec] [-v] [-q] "
+            << "<listen-port> <server-IP> <server-port>\n\n"
+            << "-u impairs client to server, -d server to client and -a both. A spec is a\n"
+            << "comma separated list of:\n"
+            << "  loss=%         independent loss, or good state loss with burst\n"
+            << "  burst=P/R      Gilbert-Elliott bursts: P% chance to enter, R% to leave\n"
+            << "  bad-loss=%     loss in the burst state (default 100)\n"
+            << "  corrupt=%      flip one to three bytes\n"
+            << "  duplicate=%    send twice\n"
+            << "  reorder=%      hold back by gap ms so later datagrams overtake\n"
+            << "  gap=ms         reorder hold (default " << PROXY_DEFAULT_REORDER_GAP_MS << ")\n"
+            << "  delay=ms       fixed delay\n"
+            << "  jitter=ms      uniform +/- variation on the delay\n"
+            << "  rate=Mbit/s    bandwidth cap\n"
+            << "  queue=ms       longest wait for the capped link (default " << PROXY_DEFAULT_QUEUE_MS << ")\n";
+        exit(EXIT_FAILURE);
+    }
+    argv += optind - 1;
+
+    unsigned short listen_port = (unsigned short) strtoul(argv[1], NULL, 0);
+    struct sockaddr_in server_addr;
+    bzero(&server_addr, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((unsigned short) strtoul(argv[3], NULL, 0));
+    if (inet_pton(AF_INET, argv[2], &server_addr.sin_addr) != 1)
+    {
+        std::cerr << "Error: Given IP address not valid: " << argv[2] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int sockfd = open_socket(listen_port);
+    if (sockfd == -1)
+    {
+        std::cerr << "Error: Could not bind to port " << listen_port << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Each direction draws from its own stream of the seed
+    Link links[2];
+    link_reset(links[PROXY_UP], impairments[PROXY_UP], seed * 2);
+    link_reset(links[PROXY_DOWN], impairments[PROXY_DOWN], seed * 2 + 1);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    log_open(level);
+    LOG_TEXT(LOG_INFO, "Proxying port %u to %s:%u with seed %u\n\n", argv[2], LOG_TEXT_SIZE,
+        listen_port, ntohs(server_addr.sin_port), seed);
+
+    proxy_run(sockfd, server_addr, links);
+
+    print_stats("up", links[PROXY_UP]);
+    print_stats("down", links[PROXY_DOWN]);
+    close(sockfd);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,114 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <map>
+#include <queue>
+#include <vector>
+#include "netio.h"
+#include "timers.h"
+#include "util.h"
+
+using std::vector;
+
+#define PROXY_SOCKET_BUFFER (4 * 1024 * 1024)
+// Forget a client that has sent nothing for this long
+#define PROXY_FLOW_IDLE_MSEC 30000
+// Longest sleep, so idle flows are reaped and signals noticed
+#define PROXY_IDLE_NSEC (100 * NANO_PER_MILLI)
+#define PROXY_DEFAULT_SEED 1
+#define PROXY_DEFAULT_REORDER_GAP_MS 2
+#define PROXY_DEFAULT_QUEUE_MS 100
+
+#define PROXY_UP 0
+#define PROXY_DOWN 1
+
+/// What one direction of the proxy does to the datagrams passing through.
+/// Chances are probabilities between 0 and 1.
+struct Impairment
+{
+	// Loss in the good state, and in the bad state once burst_enter is set
+	// (the Gilbert-Elliott model)
+	double loss;
+	double burst_enter;
+	double burst_exit;
+	double bad_loss;
+
+	double corrupt;
+	double duplicate;
+
+	// A reordered datagram is held reorder_gap_ms longer than the rest, so
+	// the ones behind it overtake it
+	double reorder;
+	unsigned int reorder_gap_ms;
+
+	unsigned int delay_ms;
+	unsigned int jitter_ms;
+
+	// A bandwidth cap of zero means none. Datagrams that would wait more
+	// than queue_ms for the link are dropped, like a full router queue.
+	double rate_mbps;
+	unsigned int queue_ms;
+};
+
+/// A datagram waiting for its release time. order breaks ties so datagrams
+/// due at the same moment leave in the order they arrived.
+struct HeldDatagram
+{
+	nano_t due;
+	uint64_t order;
+	uint32_t buffer;
+	uint32_t length;
+	uint32_t flow;
+
+	bool operator<(const HeldDatagram& other) const
+	{
+		return due != other.due ? due > other.due : order > other.order;
+	}
+};
+
+struct LinkStats
+{
+	unsigned long received;
+	unsigned long forwarded;
+	unsigned long lost;
+	unsigned long queue_drops;
+	unsigned long corrupted;
+	unsigned long duplicated;
+	unsigned long reordered;
+};
+
+/// One direction of the proxy with its own random stream, so a run is
+/// reproducible from the seed whatever the other direction does.
+struct Link
+{
+	Impairment impairment;
+	bool impaired;
+	uint64_t random;
+	bool bad;
+	nano_t link_free;
+	uint64_t order;
+	std::priority_queue<HeldDatagram> held;
+	LinkStats stats;
+};
+
+/// A client seen by the proxy. Each gets its own socket towards the server,
+/// which tells the server's replies for different clients apart.
+struct Flow
+{
+	uint32_t id;
+	struct sockaddr_in client_addr;
+	int sockfd;
+	SendBatch* outbox;
+	nano_t last_heard;
+};
+
+typedef std::pair<uint32_t, uint16_t> FlowKey;
+
+void impairment_defaults(Impairment& impairment);
+bool parse_impairment(const char* spec, Impairment& impairment);
+void link_reset(Link& link, const Impairment& impairment, uint64_t seed);
+void proxy_run(int sockfd, struct sockaddr_in server_addr, Link* links);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef RTT_H
+#define RTT_H
+
+#include "timers.h"
+
+#define RTT_INITIAL_RTO_MSEC 200
+#define RTT_MIN_RTO_NSEC (2 * NANO_PER_MILLI)
+// The G of RFC 6298: the least margin kept over SRTT. A path with a steady
+// RTT drives RTTVAR towards zero, and without this any scheduling hiccup
+// would then fire a spurious timeout.
+#define RTT_MIN_VARIANCE_NSEC (2 * NANO_PER_MILLI)
+// Kept well under the client's 5 second dead-server timeout so a backed-off
+// sender still probes before the client gives up
+#define RTT_MAX_RTO_NSEC ((nano_t)NANO_PER_SEC)
+// A version 1 client gives up after 45 ms without a packet, so its sessions
+// start at, and never back off past, the old fixed 10 ms timeout
+#define RTT_LEGACY_RTO_MSEC 10
+
+/// Smoothed round trip time estimator in the style of RFC 6298. Feed it RTT
+/// samples from acknowledgements of packets that were sent exactly once
+/// (Karn's rule) and it yields a retransmission timeout that doubles on every
+/// expiry until the next fresh sample. A legacy estimator holds the RTO at
+/// or under RTT_LEGACY_RTO_MSEC.
+struct RttEstimator
+{
+private:
+	nano_t _srtt;
+	nano_t _rttvar;
+	nano_t _rto;
+	nano_t _max_rto;
+	bool _sampled;
+
+	void clamp()
+	{
+		if (_rto < RTT_MIN_RTO_NSEC)
+			_rto = RTT_MIN_RTO_NSEC;
+		if (_rto > _max_rto)
+			_rto = _max_rto;
+	}
+
+public:
+	RttEstimator()
+	{
+		reset();
+	}
+
+	void reset(bool legacy = false)
+	{
+		_srtt = 0;
+		_rttvar = 0;
+		_max_rto = legacy ? (nano_t)RTT_LEGACY_RTO_MSEC * NANO_PER_MILLI : RTT_MAX_RTO_NSEC;
+		_rto = legacy ? _max_rto : (nano_t)RTT_INITIAL_RTO_MSEC * NANO_PER_MILLI;
+		_sampled = false;
+	}
+
+	void sample(nano_t rtt)
+	{
+		if (!_sampled)
+		{
+			_srtt = rtt;
+			_rttvar = rtt / 2;
+			_sampled = true;
+		}
+		else
+		{
+			// RTTVAR <- 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT <- 7/8 SRTT + 1/8 R
+			nano_t delta = _srtt > rtt ? _srtt - rtt : rtt - _srtt;
+			_rttvar = (3 * _rttvar + delta) / 4;
+			_srtt = (7 * _srtt + rtt) / 8;
+		}
+
+		// RTO <- SRTT + max(G, 4 * RTTVAR)
+		nano_t margin = 4 * _rttvar;
+		if (margin < RTT_MIN_VARIANCE_NSEC)
+			margin = RTT_MIN_VARIANCE_NSEC;
+		_rto = _srtt + margin;
+		clamp();
+	}
+
+	// Called when the retransmission timer expires
+	void backoff()
+	{
+		_rto *= 2;
+		clamp();
+	}
+
+	nano_t rto() { return _rto; }
+	nano_t srtt() { return _srtt; }
+	nano_t rttvar() { return _rttvar; }
+};
+
+#endif
@@ -15,336 +15,211 @@
 #include <iostream>
 #include <errno.h>
 #include <vector>
+#include <thread>
 #include <fcntl.h>
 
+#include "compress.h"
+#include "log.h"
 #include "server.h"
+#include "session.h"
+#include "stats.h"
+#include "poller.h"
+#include "netio.h"
 #include "timers.h"
 #include "util.h"
 
 using std::vector;
 
-#define SERVER_PORT 10050
-#define SERVER_TIMEOUT_MSEC 10
-#define SERVER_CANCEL_TIMEOUT_COUNT 10
-#define SERVER_CLOSE_TIMEOUT_MSEC 2000
-
 std::string packet_string(Packet& packet)
 {
-    char temp[PACKET_SIZE];
-    memset(temp, '\0', PACKET_SIZE);
-    memcpy(temp, packet.data(), packet.size());
-    std::string result(temp);
-    return result;
-}
-
-std::string packet_string(Packet& packet, size_t size)
-{
-    size_t amount = packet.size();
-    if (amount > size)
-        amount = size;
-    char temp[PACKET_SIZE];
-    memset(temp, '\0', PACKET_SIZE);
-    memcpy(temp, packet.data(), amount);
-    std::string result(temp);
-    return result;
+    return std::string(packet.data(), strnlen(packet.data(), packet.size()));
 }
 
-void receive_commands(int sockfd, GremlinInfo& info)
+void receive_commands(int sockfd, Poller& poller, GremlinInfo& info, int congestion, PacketCache& cache, bool gso)
 {
-    Packet packet;
-    struct sockaddr_in client_addr;
-    socklen_t slen = sizeof(client_addr);
+    RecvBatch inbox;
+    SendBatch outbox(sockfd);
+    if (gso && !outbox.enable_gso())
+        std::cerr << "Warning: segmentation offload is not supported, continuing without it" << std::endl;
+    SessionTable sessions;
+    TimerWheel wheel;
+    vector<TimerEvent> fired;
 
-    std::cout << "Waiting for client connection...\n\n";
+    LOG(LOG_INFO, "Waiting for client connection...\n\n");
 
     while (1)
     {
+        bool progress = false;
+        nano_t now = now_nsec();
 
-        int receiver = recvfrom(sockfd, packet.buffer, PACKET_SIZE, 0, (struct sockaddr*)&client_addr, &slen);
-        if (receiver < 0)
-        {          
-            if (errno == EWOULDBLOCK)
-            {
-                errno = 0;
-                continue;
-            }
-            else
-            {
-                std::cerr << "Error: Could not receive from client\n\n";
-                close(sockfd);
-                exit(EXIT_FAILURE);
-            }
-        }
-        else if (receiver == 0)
+        // Drain everything waiting on the socket and hand it to the sessions
+        int received = BATCH_SIZE;
+        while (received == BATCH_SIZE)
         {
-            continue;
-        }
-        else
-        {
-            if (packet.type() == GET)
-            {
-                std::string filename = packet_string(packet);
-
-                if (filename.empty())
-                {
-                    std::cout << "Warning: Received invalid filename request: Discarding\n\n";
-                }
-                else if (filename == SUCCESS_MSG)
+            received = inbox.receive(sockfd, false);
+            if (received < 0)
+            {          
+                if (errno == EWOULDBLOCK)
                 {
-                    std::cout << "Warning: Received success message: Discarding\n\n";
+                    errno = 0;
+                    break;
                 }
                 else
                 {
-                    std::cout << "Received GET request from client\n\n";
-                    vector<Packet> packets;
-                    vector<Timer> timers;
-                    if (!send_file(filename, sockfd, client_addr, info))
-                    {
-                        std::cout << "ERROR: Client stopped responding. Ending connection...\n\n";
-                        return;
-                    }
-                    receive_success_msg(sockfd, client_addr);
-
-                    std::cout << "Waiting for client connection...\n\n";
+                    std::cerr << "Error: Could not receive from client\n\n";
+                    close(sockfd);
+                    exit(EXIT_FAILURE);
                 }
             }
-        }
-    }
-}
 
-void parse_file(std::string& filename, vector<Packet>& packets, vector<Timer>& timers)
-{
-    FILE *infile;
-    infile = fopen(filename.c_str(), "rb");
-    if (infile == NULL)
-    {
-        std::cerr << "Error: Could not open file: " << filename << std::endl;
-        return;
-    }
+            for (int i = 0; i < received; ++i)
+            {
+                if (inbox.length(i) == 0)
+                    continue;
+                dispatch_packet(sessions, inbox.packet(i), inbox.addr(i), congestion, cache, wheel, now);
+                progress = true;
+            }
+        }
 
-    int current_seq = 0;
-    size_t numread = 0;
+        // Hand every due deadline to its session, unless the session has
+        // since gone or been replaced
+        fired.clear();
+        wheel.advance(now, fired);
+        for (size_t i = 0; i < fired.size(); ++i)
+        {
+            SessionTable::iterator found = sessions.find(owner_key(fired[i].owner));
+            if (found != sessions.end() && found->second.generation == fired[i].generation)
+                session_timer(found->second, fired[i], outbox, wheel, now);
+            progress = true;
+        }
 
-    while(!feof(infile))
-    {
-        char data[PACKET_SIZE - HEADER_SIZE];
-        bzero(data, PACKET_SIZE - HEADER_SIZE);
-        numread = fread(data, 1, PACKET_SIZE - HEADER_SIZE, infile);
-        if (numread != PACKET_SIZE - HEADER_SIZE && !feof(infile))
+        // Give every session a chance to send, dropping the ones that are done
+        SessionTable::iterator it = sessions.begin();
+        while (it != sessions.end())
         {
-            fclose(infile);
-            std::cerr << "Error: Could not properly read file: " << filename << std::endl;
-            exit(EXIT_FAILURE);
+            Session& session = it->second;
+            if (session_pump(session, outbox, info, wheel, now))
+                progress = true;
+
+            // Queued packets may still point into a session that is going
+            if (session.state == SESSION_FINISHED || session.state == SESSION_FAILED)
+                outbox.flush();
+            if (session.state == SESSION_FINISHED)
+            {
+                LOG_TEXT(LOG_INFO, "FINISHED: Successful GET command completed for client %s\n\n",
+                    client_string(session.client_addr).c_str(), LOG_TEXT_SIZE);
+                LOG_TEXT(LOG_INFO, "SENT: %u data packets, %u of them again, to client %s\n\n",
+                    client_string(session.client_addr).c_str(), LOG_TEXT_SIZE, session.stats.sent.get(),
+                    session.stats.retransmitted.get());
+                server_stats.finished.fetch_add(1, std::memory_order_relaxed);
+                sessions.erase(it++);
+                continue;
+            }
+            if (session.state == SESSION_FAILED)
+            {
+                LOG_TEXT(LOG_ERROR, "ERROR: Client %s stopped responding. Ending connection...\n\n",
+                    client_string(session.client_addr).c_str(), LOG_TEXT_SIZE);
+                server_stats.failed.fetch_add(1, std::memory_order_relaxed);
+                sessions.erase(it++);
+                continue;
+            }
+            ++it;
         }
+        outbox.flush();
 
-        Packet packet = Packet(data, numread, current_seq, TRN);
-        Timer timer = Timer();
-        packets.push_back(packet);
-        timers.push_back(timer);
-        current_seq = (current_seq + 1) % SEQ_NUM;
+        if (!progress)
+            poller.wait(wheel.next_deadline(now_nsec()));
     }
-
-    Packet final_packet = Packet(current_seq, TRN);
-    Timer final_timer = Timer();
-    packets.push_back(final_packet);
-    timers.push_back(final_timer);
-
-    fclose(infile);
 }
 
-bool send_file(std::string filename, int sockfd, struct sockaddr_in client_addr, GremlinInfo& info)
+void dispatch_packet(SessionTable& sessions, Packet& packet, struct sockaddr_in& client_addr, int congestion,
+    PacketCache& cache, TimerWheel& wheel, nano_t now)
 {
-    socklen_t slen = sizeof(client_addr);
-
-    vector<Packet> packets;
-    vector<Timer> timers;
-    parse_file(filename, packets, timers);
-
-    int window_end = packets.size();
-    int window_base = 0;
-    int current = 0;
-    int timeout_counter = 0;
-
-    vector<Packet> delay_packets;
-    vector<Timer> delay_timers;
-
-    while (window_base < window_end)
+    SessionTable::iterator found = sessions.find(client_key(client_addr));
+    if (packet.type() == GET)
     {
-        // Check on the delayed packets
-        if (!delay_timers.empty())
+        Request request;
+
+        if (!parse_request(packet, request))
         {
-            for (int i = 0; i < delay_timers.size(); ++i)
-            {
-                if (delay_timers[i].timeout(info.delay_amount_ms))
-                {
-                    std::cout << "SENDING: sequence " << (int)delay_packets[i].sequence() << "\n";
-                    std::cout << "DATA:\n";
-                    std::cout << packet_string(delay_packets[i], 48);
-                    std::cout << "\n\n";
-                    if (sendto(sockfd, delay_packets[i].buffer, PACKET_SIZE, 0, (struct sockaddr*) &client_addr, slen) == -1)
-                    {
-                        std::cerr << "Error: could not send packet to client" << std::endl;
-                        close(sockfd);
-                        exit(EXIT_FAILURE);
-                    }
-
-                    delay_timers.erase(delay_timers.begin() + i);
-                    delay_packets.erase(delay_packets.begin() + i);
-                    break;
-                }
-            }
+            LOG(LOG_WARN, "Warning: Received invalid filename request: Discarding\n\n");
         }
-        else if (current < (window_base + WINDOW_SIZE) && current < window_end)
+        else if (request.filename == SUCCESS_MSG)
         {
-            Packet temp = packets[current];
-            int result = send_packet(sockfd, client_addr, temp, info);
-            if (result == DELAYED)
-            {
-                Timer delay_timer = Timer();
-                delay_timer.start();
-                delay_timers.push_back(delay_timer);
-                delay_packets.push_back(temp);
-            }
-            timers[current].start();
-            current++;
+            if (found == sessions.end())
+                LOG(LOG_WARN, "Warning: Received success message: Discarding\n\n");
+            else
+                session_receive(found->second, packet, wheel, now);
         }
-        else if (timers[window_base].timeout(SERVER_TIMEOUT_MSEC))
+        else if (found != sessions.end() && found->second.state == SESSION_SENDING)
         {
-            std::cout << "TIMEOUT: Retransmitting current window\n\n";
-            current = window_base;
-            timeout_counter++;
-            if (timeout_counter > SERVER_CANCEL_TIMEOUT_COUNT)
-            {
-                return false;
-            }
-        }
-
-        Packet received;
-        struct sockaddr_in client_rec;
-        socklen_t slen_rec = sizeof(client_addr);
-
-        int receiver = recvfrom(sockfd, received.buffer, PACKET_SIZE, 0, (struct sockaddr*)&client_rec, &slen_rec);
-        if (receiver < 0)
-        {          
-            if (errno == EWOULDBLOCK)
-            {
-                errno = 0;
-            }
-            else
-            {
-                std::cerr << "Error: Could not receive from client" << std::endl;
-                close(sockfd);
-                exit(EXIT_FAILURE);
-            }
+            LOG_TEXT(LOG_WARN, "Warning: Received duplicate GET request from client %s: Discarding\n\n",
+                client_string(client_addr).c_str(), LOG_TEXT_SIZE);
         }
-        else if (receiver > 0)
+        else
         {
-            timeout_counter = 0;
-
-            if (received.type() == ACK)
-            {
-                std::cout << "ACKNOLEDGE: sequence " << (int) received.sequence() << "\n\n";
-                if (received.sequence() == ((window_base + 1) % SEQ_NUM))
-                {
-                    window_base++;
-                    if (current < window_base)
-                        current = window_base;
-                }             
-            }
-            else if (received.type() == NAK)
-            {
-                std::cout << "DAMAGED DATA: sequence " << (int) received.sequence() << "\n\n";
-                current = window_base;
-            }
+            LOG_TEXT(LOG_INFO, "Received GET request from client %s (version %u, payload %u bytes, %S)\n\n",
+                client_string(client_addr).c_str(), LOG_TEXT_SIZE,
+                packet.version(), request.payload_size, (uintptr_t)checksum_name(request.checksum));
+            if (request.offset > 0 || request.length > 0)
+                LOG(LOG_INFO, "Serving bytes from %u (length %u, 0 for the rest)\n\n",
+                    request.offset, request.length);
+            if (request.compression != COMPRESSION_NONE)
+                LOG(LOG_INFO, "Compressing payloads with %S\n\n", (uintptr_t)compression_name(request.compression));
+            if (request.fec_group > 0)
+                LOG(LOG_INFO, "Sending %u parity packets after every %u data packets\n\n",
+                    request.fec_parity, request.fec_group);
+            if (request.stripes > 1)
+                LOG(LOG_INFO, "Serving stripe %u of %u in blocks of %u payloads\n\n",
+                    request.stripe + 1, request.stripes, request.stripe_block);
+            session_start(sessions[client_key(client_addr)], request, packet.version(), client_addr, congestion, cache);
         }
     }
-
-    return true;
-}
-
-int send_packet(int sockfd, struct sockaddr_in client_addr, Packet& packet, GremlinInfo& info)
-{
-    int result = gremlin(packet.data(), info.corrupt_chance, info.loss_chance, info.delay_chance);
-    if (result == FINE)
+    else if (found != sessions.end())
     {
-        std::cout << "SENDING: sequence " << (int)packet.sequence() << "\n";
-        std::cout << "DATA:\n";
-        std::cout << packet_string(packet, 48);
-        std::cout << "\n\n";
-        if (sendto(sockfd, packet.buffer, PACKET_SIZE, 0, (struct sockaddr*) &client_addr, sizeof(client_addr)) == -1)
-        {
-            std::cerr << "Error: could not send packet to client" << std::endl;
-            close(sockfd);
-            exit(EXIT_FAILURE);
-        }
+        session_receive(found->second, packet, wheel, now);
     }
-
-    return result;
 }
 
-void receive_success_msg(int sockfd, struct sockaddr_in client_addr)
+// Runs a copy of the packet through the gremlin in the batch's next slot and
+// queues it if it survives. A DELAYED packet is left in batch.next() for the
+// caller to hold on to. When the gremlin cannot damage it, a surviving packet
+// is queued from where it is, so it must stay put until the batch is flushed.
+int send_packet(SendBatch& batch, struct sockaddr_in client_addr, Packet& packet, GremlinInfo& info)
 {
-    Packet received;
-    struct sockaddr_in client_rec;
-    socklen_t slen_rec = sizeof(client_addr);
-    Timer final_timer = Timer();
-    final_timer.start();
-
-    while (1)
+    if (info.corrupt_chance <= 0)
     {
-        if (final_timer.timeout(SERVER_CLOSE_TIMEOUT_MSEC))
+        int result = gremlin(packet.data(), packet.size(), 0, info.loss_chance, info.delay_chance);
+        if (result == FINE)
         {
-            break;
+            LOG_TEXT(LOG_DEBUG, "SENDING: sequence %u\nDATA:\n%s\n\n", packet.data(), packet.size(), packet.sequence());
+            batch.push(client_addr, packet.buffer, packet.length());
         }
-        int receiver = recvfrom(sockfd, received.buffer, PACKET_SIZE, 0, (struct sockaddr*)&client_rec, &slen_rec);
-        if (receiver < 0)
-        {          
-            if (errno == EWOULDBLOCK)
-            {
-                errno = 0;
-            }
-            else
-            {
-                std::cerr << "Error: Could not receive from client" << std::endl;
-                close(sockfd);
-                exit(EXIT_FAILURE);
-            }
-        }
-        else if (receiver > 0)
+        else if (result == DELAYED)
         {
-            if (received.type() == GET)
-            {
-                break;
-            }
+            batch.next().copy_from(packet);
         }
+        return result;
     }
 
-    std::cout << "FINISHED: Successful GET command completed" << std::endl << std::endl;
-}
+    Packet& copy = batch.next();
+    copy.copy_from(packet);
 
-int main(int argc, char** argv)
-{
-	if (argc != 5)
+    int result = gremlin(copy.data(), copy.size(), info.corrupt_chance, info.loss_chance, info.delay_chance);
+    if (result == FINE)
     {
-        std::cout << "Usage: " << argv[0] << " ";
-        std::cout << "<corrupt %%> <loss %%> <delay %%> <delay-amount-ms>" << std::endl;
-        exit(EXIT_FAILURE);
+        LOG_TEXT(LOG_DEBUG, "SENDING: sequence %u\nDATA:\n%s\n\n", copy.data(), copy.size(), copy.sequence());
+        batch.push(client_addr);
     }
 
-    GremlinInfo gremlin_info;
-
-    gremlin_info.corrupt_chance = atoi(argv[1]);
-    gremlin_info.loss_chance = atoi(argv[2]);
-    gremlin_info.delay_chance = atoi(argv[3]);
-    gremlin_info.delay_amount_ms = atoi(argv[4]);
-
-	struct sockaddr_in server_addr;
-	struct sockaddr_in client_addr;
-    int sockfd = -1; 
-
-    socklen_t slen = sizeof(client_addr);
+    return result;
+}
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+// Creates a non-blocking socket bound to the server port. Sockets opened with
+// reuse share the port, and the kernel hands each of them its own clients.
+int open_server_socket(bool reuse)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd == -1)
     {
     	perror("Error: Could not create socket\n");
@@ -356,6 +231,21 @@ int main(int argc, char** argv)
     flags |= O_NONBLOCK;
     fcntl(sockfd, F_SETFL, flags);
 
+    int enable = 1;
+    if (reuse && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (char*)&enable, sizeof(enable)) == -1)
+    {
+        perror("Error: Could not share the server port\n");
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+
+    // Window bursts to many clients and their ACKs arrive in batches, so give
+    // the kernel queues room for them (capped by net.core.[rw]mem_max)
+    int buffer_size = SERVER_SOCKET_BUFFER;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (char*)&buffer_size, sizeof(buffer_size));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, (char*)&buffer_size, sizeof(buffer_size));
+
+	struct sockaddr_in server_addr;
     bzero(&server_addr, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(SERVER_PORT);
@@ -367,16 +257,113 @@ int main(int argc, char** argv)
     	close(sockfd);
     	exit(EXIT_FAILURE);
     }
+    return sockfd;
+}
+
+// One event loop with its own socket, sessions and timers; the packet cache
+// is shared by all of them
+void serve(int sockfd, GremlinInfo info, int congestion, PacketCache* cache, bool gso)
+{
+    Poller poller;
+    if (!poller.open(sockfd))
+    {
+        perror("Error: Could not create event poller\n");
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
 
-    printf("Successfully bound server to port %d and listening for clients...\n\n", SERVER_PORT);
-	
-	receive_commands(sockfd, gremlin_info); // include params for gremlin?
- 
+    receive_commands(sockfd, poller, info, congestion, *cache, gso);
     close(sockfd);
+}
+
+int main(int argc, char** argv)
+{
+    int congestion = CONGESTION_RENO;
+    int level = LOG_DEFAULT_LEVEL;
+    int threads = 1;
+    size_t cache_bytes = CACHE_DEFAULT_BYTES;
+    bool gso = false;
+    const char* stats_path = NULL;
+
+    int option;
+    while ((option = getopt(argc, argv, "c:t:C:S:gvq")) != -1)
+    {
+        switch (option)
+        {
+            case 'S':
+                stats_path = optarg;
+            break;
+            case 'g':
+                gso = true;
+            break;
+            case 'C':
+                cache_bytes = (size_t)strtoul(optarg, NULL, 0) * 1024 * 1024;
+            break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads < 1 || threads > SERVER_MAX_THREADS)
+                    argc = 0;
+            break;
+            case 'c':
+                if (!strcmp(optarg, "reno"))
+                    congestion = CONGESTION_RENO;
+                else if (!strcmp(optarg, "vegas"))
+                    congestion = CONGESTION_VEGAS;
+                else
+                    argc = 0;
+            break;
+            case 'v':
+                level++;
+            break;
+            case 'q':
+                level = LOG_WARN;
+            break;
+            default:
+                argc = 0;
+            break;
+        }
+    }
+
+	if (argc - optind != 4)
+    {
+        std::cout << "Usage: " << argv[0] << " ";
+        std::cout << "[-c reno|vegas] [-t threads] [-C cache-MB] [-S stats-socket] [-g] [-v] [-q] <corrupt %%> <loss %%> <delay %%> <delay-amount-ms>" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    argv += optind - 1;
+
+    GremlinInfo gremlin_info;
+
+    gremlin_info.corrupt_chance = atoi(argv[1]);
+    gremlin_info.loss_chance = atoi(argv[2]);
+    gremlin_info.delay_chance = atoi(argv[3]);
+    gremlin_info.delay_amount_ms = atoi(argv[4]);
+
+    // Each thread serves the clients the kernel steers to its socket; a
+    // client keeps its address, so it always lands on the same thread
+    vector<int> sockets;
+    for (int i = 0; i < threads; ++i)
+        sockets.push_back(open_server_socket(threads > 1));
+
+    log_open(level);
+    LOG(LOG_INFO, "Successfully bound server to port %u and listening for clients...\n\n", SERVER_PORT);
+    if (threads > 1)
+        LOG(LOG_INFO, "Serving on %u threads\n\n", threads);
+    if (stats_path != NULL)
+        server_stats.serve(stats_path);
+
+    PacketCache cache(cache_bytes);
+    vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i)
+        workers.push_back(std::thread(serve, sockets[i], gremlin_info, congestion, &cache, gso));
+    serve(sockets[0], gremlin_info, congestion, &cache, gso);
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
     exit(EXIT_SUCCESS);
 }
 
-int gremlin(char *data, int corrupt_chance, int loss_chance, int delay_chance)
+int gremlin(char *data, int length, int corrupt_chance, int loss_chance, int delay_chance)
 {
     if (corrupt_chance < 0)
         corrupt_chance = 0;
@@ -390,42 +377,48 @@ int gremlin(char *data, int corrupt_chance, int loss_chance, int delay_chance)
         delay_chance = 0;
     if (delay_chance > 100)
         delay_chance = 100;
-    int corrupt_roll = rand() % 101;
-    int loss_roll = rand() % 101;
-    int delay_roll = rand() % 101;
-    if (loss_roll <= loss_chance) 
+    // Rolls run 0 to 99, so a chance of 0% never fires and 100% always does
+    int corrupt_roll = rand() % 100;
+    int loss_roll = rand() % 100;
+    int delay_roll = rand() % 100;
+    if (loss_roll < loss_chance) 
     {
         return LOST;
     }
-    if (corrupt_roll <= corrupt_chance)
+    if (corrupt_roll < corrupt_chance && length > 0)
     {
         int num_corrupt = rand() % 101;
+        // Short payloads cannot take as many distinct corrupted bytes
+        if (length < 2)
+            num_corrupt = 0;
+        else if (length < 3 && num_corrupt > 90)
+            num_corrupt = 90;
         if (num_corrupt <= 70)
         {
-            int corrupt_byte = rand() % (PACKET_SIZE - HEADER_SIZE);
+            int corrupt_byte = rand() % length;
             data[corrupt_byte] = ~data[corrupt_byte];
         }
         else if (num_corrupt <= 90)
         {
-            int corrupt_byte = rand() % (PACKET_SIZE - HEADER_SIZE);
+            int corrupt_byte = rand() % length;
             data[corrupt_byte] = ~data[corrupt_byte];
 
             int prev_corrupt = corrupt_byte;
             while (prev_corrupt == corrupt_byte)
             {
-                corrupt_byte = rand() % (PACKET_SIZE - HEADER_SIZE);
+                corrupt_byte = rand() % length;
             }
             data[corrupt_byte] = ~data[corrupt_byte];
         }
         else
         {
-            int corrupt_byte = rand() % (PACKET_SIZE - HEADER_SIZE);
+            int corrupt_byte = rand() % length;
             data[corrupt_byte] = ~data[corrupt_byte];
 
             int prev_corrupt1 = corrupt_byte;
             while (prev_corrupt1 == corrupt_byte)
             {
-                corrupt_byte = rand() % (PACKET_SIZE - HEADER_SIZE);
+                corrupt_byte = rand() % length;
             }
             data[corrupt_byte] = ~data[corrupt_byte];
 
@@ -433,12 +426,12 @@ int gremlin(char *data, int corrupt_chance, int loss_chance, int delay_chance)
             while (prev_corrupt1 == corrupt_byte
                 || prev_corrupt2 == corrupt_byte)
             {
-                corrupt_byte = rand() % (PACKET_SIZE - HEADER_SIZE);
+                corrupt_byte = rand() % length;
             }
             data[corrupt_byte] = ~data[corrupt_byte];
         }
     }
-    if (delay_roll <= delay_chance)
+    if (delay_roll < delay_chance)
     {
         return DELAYED;
     }
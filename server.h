@@ -9,23 +9,34 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "util.h"
+#include "poller.h"
+#include "netio.h"
+#include "session.h"
 #include "timers.h"
+#include "timer_wheel.h"
+#include "cache.h"
 
 using std::vector;
 
+#define SERVER_PORT 10050
+#define SERVER_CANCEL_TIMEOUT_COUNT 10
+#define SERVER_CLOSE_TIMEOUT_MSEC 2000
+#define SERVER_SOCKET_BUFFER (4 * 1024 * 1024)
+#define SERVER_MAX_THREADS 64
+
 #define FINE 0
 #define LOST 1
 #define DELAYED 2
 
 std::string packet_string(Packet& packet);
-std::string packet_string(Packet& packet, size_t size);
-void receive_commands(int sockfd, GremlinInfo& info);
-void parse_file(std::string& filename, vector<Packet>& packets, vector<Timer>& timers);
-int send_packet(int sockfd, struct sockaddr_in client_addr, Packet& packet, GremlinInfo& info);
-void receive_success_msg(int sockfd, struct sockaddr_in client_addr);
-bool send_file(std::string filename, int sockfd, struct sockaddr_in client_addr, GremlinInfo& info);
-
-int gremlin(char *data, int corrupt_chance, int loss_chance, int delay_chance);
+int open_server_socket(bool reuse);
+void serve(int sockfd, GremlinInfo info, int congestion, PacketCache* cache, bool gso);
+void receive_commands(int sockfd, Poller& poller, GremlinInfo& info, int congestion, PacketCache& cache, bool gso);
+void dispatch_packet(SessionTable& sessions, Packet& packet, struct sockaddr_in& client_addr, int congestion,
+    PacketCache& cache, TimerWheel& wheel, nano_t now);
+int send_packet(SendBatch& batch, struct sockaddr_in client_addr, Packet& packet, GremlinInfo& info);
+
+int gremlin(char *data, int length, int corrupt_chance, int loss_chance, int delay_chance);
 
 
 #endif
\ No newline at end of file
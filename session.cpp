@@ -0,0 +1,661 @@
+/// @file session.cpp
+///
+/// Go-Back-N and Selective Repeat sender state for a single client, with its
+/// congestion and flow controlled window. The server keeps one Session
+/// per client address and steps each of them from its event loop.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+
+#include "log.h"
+#include "session.h"
+#include "server.h"
+#include "poller.h"
+#include "util.h"
+
+// Shared by the sessions of every server thread
+static std::atomic<uint32_t> next_generation(0);
+
+ClientKey client_key(const struct sockaddr_in& addr)
+{
+    return ClientKey(addr.sin_addr.s_addr, addr.sin_port);
+}
+
+// The client key packed into a TimerEvent's owner
+static uint64_t session_owner(const struct sockaddr_in& addr)
+{
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+ClientKey owner_key(uint64_t owner)
+{
+    return ClientKey((uint32_t)(owner >> 16), (uint16_t)owner);
+}
+
+std::string client_string(const struct sockaddr_in& addr)
+{
+    std::ostringstream out;
+    out << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port);
+    return out.str();
+}
+
+bool session_start(Session& session, Request& request, uint8_t version, struct sockaddr_in client_addr,
+    int congestion, PacketCache& cache)
+{
+    session.client_addr = client_addr;
+    session.owner = session_owner(client_addr);
+    session.generation = next_generation++;
+    session.state = SESSION_SENDING;
+    session.version = version < PROTOCOL_VERSION ? version : PROTOCOL_VERSION;
+    session.payload_size = request.payload_size;
+    session.mode = request.mode;
+    session.checksum = request.checksum;
+    session.sequence_mask = sequence_mask(session.version);
+    session.max_window = window_limit(session.version);
+
+    session.delay_blocks.clear();
+    session.delay_free.clear();
+    session.resend.clear();
+    session.timed_out = false;
+    // Version 1 clients have no patience for a backed-off timeout
+    session.rtt.reset(session.version < 2);
+    session.recover = 0;
+    session.loss_scan = 0;
+
+    session.window_end = 0;
+    session.window_base = 0;
+    session.current = 0;
+    session.next_new = 0;
+    session.dupacks = 0;
+    session.dupack_threshold = SESSION_DUPACK_THRESHOLD + request.fec_group;
+    session.timeout_counter = 0;
+    session.stats.start(client_addr, request.filename);
+
+    if (!session.packets.open(request, session.version, session.max_window, &cache))
+    {
+        std::cerr << "Error: Could not open file: " << request.filename << std::endl;
+        session.state = SESSION_FAILED;
+        return false;
+    }
+    session.window_end = session.packets.count();
+
+    // A window never needs more slots than the transfer has packets
+    if (session.max_window > session.window_end)
+        session.max_window = session.window_end;
+    session.sent.assign(session.max_window, 0);
+    session.acked.assign(session.max_window, false);
+    session.retransmitted.assign(session.max_window, false);
+    session.lost.assign(session.max_window, false);
+    session.congestion.reset(congestion, session.max_window);
+    session.peer_window = session.max_window;
+    session.parity.open(request, session.version, session.max_window);
+
+    session.file_info.clear();
+    if (request.info)
+    {
+        session.file_info.assign(1, MIN_PAYLOAD_SIZE);
+        session.file_info[0].set_version(session.version);
+        session.file_info[0].set_checksum_type(session.checksum);
+        build_info(session.file_info[0], session.packets.info());
+    }
+    return true;
+}
+
+size_t session_window(Session& session)
+{
+    size_t window = session.congestion.window();
+    if (window > session.peer_window)
+        window = session.peer_window;
+    return window;
+}
+
+static void schedule(Session& session, TimerWheel& wheel, uint32_t kind, nano_t due, size_t index, nano_t stamp)
+{
+    TimerEvent event;
+    event.due = due;
+    event.owner = session.owner;
+    event.generation = session.generation;
+    event.kind = kind;
+    event.index = index;
+    event.stamp = stamp;
+    wheel.schedule(event);
+}
+
+// Moves the session to its closing state, where it waits a while for the
+// client's success message before being dropped. Its packets go, so the
+// batch must not be left pointing at any of them.
+static void session_close(Session& session, SendBatch& batch, TimerWheel& wheel, nano_t now)
+{
+    batch.flush();
+    session.state = SESSION_CLOSING;
+    schedule(session, wheel, SESSION_TIMER_CLOSE, now + (nano_t)SERVER_CLOSE_TIMEOUT_MSEC * NANO_PER_MILLI, 0, now);
+    session.packets.close();
+    session.parity.close();
+}
+
+// Starts the retransmit timer of the packet at index, which was sent at now
+static void start_timer(Session& session, TimerWheel& wheel, size_t index, nano_t now)
+{
+    session.sent[index % session.max_window] = now;
+    schedule(session, wheel, SESSION_TIMER_RETRANSMIT, now + session.rtt.rto(), index, now);
+}
+
+// The delayed packet held in the given slot
+static Packet& delayed_packet(Session& session, size_t slot)
+{
+    return session.delay_blocks[slot / SESSION_DELAY_BLOCK][slot % SESSION_DELAY_BLOCK];
+}
+
+// Holds on to the packet the gremlin delayed, in batch.next(), until its
+// release event fires
+static void hold_delayed(Session& session, SendBatch& batch, GremlinInfo& info, TimerWheel& wheel, nano_t now)
+{
+    if (session.delay_free.empty())
+    {
+        // Slots fit this session's payloads, or its parity packets
+        size_t first = session.delay_blocks.size() * SESSION_DELAY_BLOCK;
+        session.delay_blocks.resize(session.delay_blocks.size() + 1);
+        session.delay_blocks.back().assign(SESSION_DELAY_BLOCK, session.payload_size + FEC_OVERHEAD);
+        for (size_t i = SESSION_DELAY_BLOCK; i > 0; --i)
+            session.delay_free.push_back(first + i - 1);
+    }
+    size_t slot = session.delay_free.back();
+    session.delay_free.pop_back();
+    delayed_packet(session, slot).copy_from(batch.next());
+    schedule(session, wheel, SESSION_TIMER_DELAY, now + (nano_t)info.delay_amount_ms * NANO_PER_MILLI, slot, now);
+}
+
+// Queues the parity packets of the group just completed. They are never
+// resent and have no timers; a group they cannot repair is recovered the
+// usual way.
+static void send_parity(Session& session, SendBatch& batch, GremlinInfo& info, TimerWheel& wheel, nano_t now)
+{
+    for (size_t row = 0; row < session.parity.parity_count(); ++row)
+    {
+        if (send_packet(batch, session.client_addr, session.parity.parity(row), info) == DELAYED)
+            hold_delayed(session, batch, info, wheel, now);
+    }
+}
+
+// Covers what has gone out of the current group with parity when the
+// window holds up the rest of it behind its own first packets. A loss there
+// would otherwise wait out the RTO, as the group could not be completed
+// until the loss was repaired.
+static void flush_parity(Session& session, SendBatch& batch, GremlinInfo& info, TimerWheel& wheel, nano_t now)
+{
+    if (!session.parity.enabled() || session.current >= session.window_end
+        || session.window_base < session.next_new - session.next_new % session.parity.group())
+        return;
+    if (session.parity.flush())
+        send_parity(session, batch, info, wheel, now);
+}
+
+// Queues the packet at the given index and starts its retransmit timer.
+// Returns the gremlin's verdict, or -1 if the packet could not be read.
+static int send_window_packet(Session& session, SendBatch& batch, GremlinInfo& info, TimerWheel& wheel,
+    size_t index, nano_t now)
+{
+    Packet* packet = session.packets.get(index);
+    if (packet == NULL)
+    {
+        session.state = SESSION_FAILED;
+        return -1;
+    }
+
+    // The client holds off acknowledging packet 0 until it knows the file
+    if (index == 0 && session.file_info.size() > 0
+        && send_packet(batch, session.client_addr, session.file_info[0], info) == DELAYED)
+        hold_delayed(session, batch, info, wheel, now);
+
+    int result = send_packet(batch, session.client_addr, *packet, info);
+    start_timer(session, wheel, index, now);
+    if (result == DELAYED)
+        hold_delayed(session, batch, info, wheel, now);
+
+    // Karn's rule: a resent packet's ACK cannot be matched to one send, so
+    // it must not feed the RTT estimate
+    bool first = index >= session.next_new;
+    session.retransmitted[index % session.max_window] = !first;
+    session.stats.sent.add();
+    if (first)
+        session.next_new = index + 1;
+    else
+        session.stats.retransmitted.add();
+
+    if (first && session.parity.enabled()
+        && session.parity.add(*packet, index, index + 1 == session.window_end))
+        send_parity(session, batch, info, wheel, now);
+    return result;
+}
+
+// Flags the packet at index for Selective Repeat to resend on its next pump
+static void mark_lost(Session& session, size_t index)
+{
+    size_t slot = index % session.max_window;
+    if (session.lost[slot])
+        return;
+    session.lost[slot] = true;
+    session.resend.push_back(index);
+}
+
+// Reacts to an expired retransmit timer: backs off the RTO and the
+// congestion window, and gives up on a client that has stopped answering.
+// Returns false once the session has failed.
+static bool session_timed_out(Session& session)
+{
+    session.timed_out = false;
+    session.stats.timeouts.add();
+    session.rtt.backoff();
+    session.congestion.timeout();
+    session.recover = session.next_new;
+    session.timeout_counter++;
+    if (session.timeout_counter > SERVER_CANCEL_TIMEOUT_COUNT)
+    {
+        session.state = SESSION_FAILED;
+        return false;
+    }
+    return true;
+}
+
+// Selective Repeat: resend only the packets found lost or timed out, then
+// fill the rest of the window with new ones
+static bool session_pump_selective(Session& session, SendBatch& batch, GremlinInfo& info, TimerWheel& wheel,
+    nano_t now)
+{
+    bool progress = !session.resend.empty();
+
+    for (size_t i = 0; i < session.resend.size(); ++i)
+    {
+        size_t index = session.resend[i];
+        size_t slot = index % session.max_window;
+        if (index < session.window_base || !session.lost[slot])
+            continue;
+        session.lost[slot] = false;
+        if (session.acked[slot])
+            continue;
+
+        if (send_window_packet(session, batch, info, wheel, index, now) == -1)
+            return true;
+    }
+    session.resend.clear();
+
+    if (session.timed_out && !session_timed_out(session))
+        return true;
+
+    while (session.current < (session.window_base + session_window(session)) && session.current < session.window_end)
+    {
+        progress = true;
+        session.acked[session.current % session.max_window] = false;
+        session.lost[session.current % session.max_window] = false;
+        int result = send_window_packet(session, batch, info, wheel, session.current, now);
+        if (result == -1)
+            return true;
+        session.current++;
+    }
+    flush_parity(session, batch, info, wheel, now);
+
+    return progress;
+}
+
+bool session_pump(Session& session, SendBatch& batch, GremlinInfo& info, TimerWheel& wheel, nano_t now)
+{
+    if (session.state != SESSION_SENDING)
+        return false;
+
+    if (session.window_base >= session.window_end)
+    {
+        session_close(session, batch, wheel, now);
+        return true;
+    }
+
+    if (session.mode == MODE_SELECTIVE_REPEAT)
+        return session_pump_selective(session, batch, info, wheel, now);
+
+    bool progress = false;
+    if (session.timed_out)
+    {
+        LOG(LOG_DEBUG, "TIMEOUT: Retransmitting current window\n\n");
+        session.current = session.window_base;
+        progress = true;
+        if (!session_timed_out(session))
+            return true;
+    }
+
+    // Queue the rest of the window in one go. A delayed packet is held on
+    // the wheel and no longer holds back the ones behind it.
+    while (session.current < (session.window_base + session_window(session)) && session.current < session.window_end)
+    {
+        progress = true;
+        if (send_window_packet(session, batch, info, wheel, session.current, now) == -1)
+            return true;
+        session.current++;
+    }
+    flush_parity(session, batch, info, wheel, now);
+    return progress;
+}
+
+void session_timer(Session& session, TimerEvent& event, SendBatch& batch, TimerWheel& wheel, nano_t now)
+{
+    if (event.kind == SESSION_TIMER_DELAY)
+    {
+        Packet& delayed = delayed_packet(session, event.index);
+        LOG_TEXT(LOG_DEBUG, "SENDING: sequence %u\nDATA:\n%s\n\n", delayed.data(), delayed.size(), delayed.sequence());
+        batch.next().copy_from(delayed);
+        batch.push(session.client_addr);
+        session.delay_free.push_back(event.index);
+        return;
+    }
+    if (event.kind == SESSION_TIMER_CLOSE)
+    {
+        if (session.state == SESSION_CLOSING)
+            session.state = SESSION_FINISHED;
+        return;
+    }
+    if (session.state != SESSION_SENDING)
+        return;
+
+    // A retransmit timer is stale once its packet is acknowledged or sent
+    // again. One that fires early because the RTO has since backed off is
+    // put back for the rest of its time.
+    size_t index = event.index;
+    size_t slot = index % session.max_window;
+    if (index < session.window_base || index >= session.current || session.acked[slot]
+        || session.sent[slot] != event.stamp)
+        return;
+    if (now - session.sent[slot] <= session.rtt.rto())
+    {
+        event.due = session.sent[slot] + session.rtt.rto() + 1;
+        wheel.schedule(event);
+        return;
+    }
+
+    if (session.mode == MODE_SELECTIVE_REPEAT)
+    {
+        if (session.lost[slot])
+            return;
+        LOG(LOG_DEBUG, "TIMEOUT: Retransmitting sequence %u\n\n", index & session.sequence_mask);
+        mark_lost(session, index);
+        session.timed_out = true;
+    }
+    else if (index == session.window_base)
+    {
+        session.timed_out = true;
+    }
+}
+
+// Feeds an RTT sample to the estimator and the server's histogram
+static void sample_rtt(Session& session, nano_t sample)
+{
+    session.rtt.sample(sample);
+    session.stats.srtt_nsec.set(session.rtt.srtt());
+    server_stats.rtt.record(sample);
+}
+
+// Counts the payload of the packet at index, which the client now has
+static void count_delivered(Session& session, size_t index)
+{
+    Packet* packet = session.packets.get(index);
+    if (packet != NULL)
+        session.stats.bytes_delivered.add(packet->size());
+}
+
+// Counts a reply from the client that did not move the window, and how
+// full the window is now
+static void count_reply(Session& session, Packet& received, size_t base)
+{
+    if (received.type() == NAK)
+        session.stats.naks.add();
+    else if (received.type() == ACK && session.window_base == base)
+        session.stats.dupacks.add();
+    size_t in_flight = session.current - session.window_base;
+    session.stats.in_flight.set(in_flight);
+    server_stats.window.record(in_flight);
+}
+
+// Feeds the RTT estimator and the congestion window from the ACK of the
+// packet at index
+static void packet_acked(Session& session, size_t index, nano_t now)
+{
+    size_t slot = index % session.max_window;
+    nano_t sample = 0;
+    if (!session.retransmitted[slot])
+    {
+        sample = now - session.sent[slot];
+        sample_rtt(session, sample);
+    }
+    session.congestion.acked(1, sample);
+    count_delivered(session, index);
+}
+
+// Shrinks the congestion window for a lost or damaged packet, once for all
+// the losses within the same window of data
+static void packet_lost(Session& session)
+{
+    if (session.window_base < session.recover)
+        return;
+    session.congestion.loss();
+    session.recover = session.next_new;
+}
+
+// Takes in the receive window the client advertised
+static void update_peer_window(Session& session, Ack& ack)
+{
+    session.peer_window = ack.window;
+    if (session.peer_window < 1)
+        session.peer_window = 1;
+    if (session.peer_window > session.max_window)
+        session.peer_window = session.max_window;
+}
+
+// Finds the in-flight packet a Selective Repeat ACK or NAK refers to.
+// Returns false if the sequence number is not outstanding.
+static bool window_index(Session& session, uint32_t sequence, size_t& index)
+{
+    size_t offset = (sequence - (uint32_t)session.window_base) & session.sequence_mask;
+    index = session.window_base + offset;
+    return offset < session.max_window && index < session.current;
+}
+
+// Turns a cumulative ACK into the index of the first packet the client is
+// still missing. Returns false unless that is past the window base and no
+// further than what has been sent.
+static bool cumulative_index(Session& session, uint32_t sequence, size_t& index)
+{
+    size_t offset = (sequence - (uint32_t)session.window_base) & session.sequence_mask;
+    index = session.window_base + offset;
+    return offset > 0 && index <= session.next_new;
+}
+
+// Slides the window base up to end. Only the newest of the packets covered
+// gives a fair RTT sample, as the ACKs for the others may have been lost.
+static void acknowledge_through(Session& session, size_t end, TimerWheel& wheel, nano_t now)
+{
+    size_t last = (end - 1) % session.max_window;
+    nano_t sample = 0;
+    if (!session.retransmitted[last] && !session.acked[last])
+    {
+        sample = now - session.sent[last];
+        sample_rtt(session, sample);
+    }
+
+    size_t count = 0;
+    for (; session.window_base < end; ++session.window_base)
+    {
+        size_t slot = session.window_base % session.max_window;
+        if (!session.acked[slot])
+        {
+            count++;
+            count_delivered(session, session.window_base);
+        }
+        session.acked[slot] = false;
+    }
+    session.congestion.acked(count, sample);
+
+    if (session.current < session.window_base)
+        session.current = session.window_base;
+    if (session.loss_scan < session.window_base)
+        session.loss_scan = session.window_base;
+    session.dupacks = 0;
+    session.packets.prefetch(session.window_base);
+
+    // Go-Back-N only times the base, and the new base's own timer may have
+    // fired and been ignored while an older packet held that place
+    if (session.mode == MODE_GO_BACK_N && session.window_base < session.current)
+    {
+        nano_t sent = session.sent[session.window_base % session.max_window];
+        schedule(session, wheel, SESSION_TIMER_RETRANSMIT, sent + session.rtt.rto(), session.window_base, sent);
+    }
+}
+
+// Marks the packets in the client's SACK blocks as received, so they are
+// never resent, and resends the holes that the duplicate ACK threshold or
+// more SACKed packets have overtaken without waiting out their RTO
+static void apply_sack(Session& session, Ack& ack, nano_t now)
+{
+    size_t highest = session.window_base;
+    for (int i = 0; i < ack.sack_count; ++i)
+    {
+        size_t start;
+        size_t length = (ack.sack[i].end - ack.sack[i].start) & session.sequence_mask;
+        if (!window_index(session, ack.sack[i].start, start) || length > session.current - start)
+            continue;
+
+        for (size_t index = start; index < start + length; ++index)
+        {
+            if (session.acked[index % session.max_window])
+                continue;
+            packet_acked(session, index, now);
+            session.acked[index % session.max_window] = true;
+        }
+        if (start + length > highest)
+            highest = start + length;
+    }
+
+    size_t threshold = session.dupack_threshold;
+    if (highest < session.window_base + threshold)
+        return;
+    for (; session.loss_scan <= highest - threshold; ++session.loss_scan)
+    {
+        size_t slot = session.loss_scan % session.max_window;
+        if (session.acked[slot] || session.retransmitted[slot])
+            continue;
+        LOG(LOG_DEBUG, "FAST RETRANSMIT: sequence %u\n\n", session.loss_scan & session.sequence_mask);
+        mark_lost(session, session.loss_scan);
+        packet_lost(session);
+    }
+}
+
+static void session_receive_selective(Session& session, Packet& received, Ack& ack, TimerWheel& wheel,
+    nano_t now)
+{
+    size_t index;
+    if (received.type() == ACK && session.version >= 3)
+    {
+        LOG(LOG_DEBUG, "ACKNOLEDGE: sequence %u with %u SACK blocks\n\n", ack.sequence, ack.sack_count);
+        if (cumulative_index(session, ack.sequence, index) && index <= session.current)
+            acknowledge_through(session, index, wheel, now);
+        apply_sack(session, ack, now);
+    }
+    else if (received.type() == ACK)
+    {
+        // Older clients acknowledge each packet on its own
+        LOG(LOG_DEBUG, "ACKNOLEDGE: sequence %u\n\n", ack.sequence);
+        if (!window_index(session, ack.sequence, index))
+            return;
+
+        if (!session.acked[index % session.max_window])
+            packet_acked(session, index, now);
+        session.acked[index % session.max_window] = true;
+
+        if (index == session.window_base)
+        {
+            while (session.window_base < session.current && session.acked[session.window_base % session.max_window])
+            {
+                session.acked[session.window_base % session.max_window] = false;
+                session.window_base++;
+            }
+            session.dupacks = 0;
+            session.packets.prefetch(session.window_base);
+        }
+        else if (++session.dupacks == session.dupack_threshold)
+        {
+            // Later packets keep getting through, so the base was most likely
+            // lost: resend it now rather than waiting out the RTO
+            LOG(LOG_DEBUG, "FAST RETRANSMIT: sequence %u\n\n", session.window_base & session.sequence_mask);
+            mark_lost(session, session.window_base);
+            packet_lost(session);
+        }
+    }
+    else if (received.type() == NAK)
+    {
+        LOG(LOG_DEBUG, "DAMAGED DATA: sequence %u\n\n", ack.sequence);
+        if (window_index(session, ack.sequence, index) && !session.acked[index % session.max_window])
+        {
+            mark_lost(session, index);
+            packet_lost(session);
+        }
+    }
+}
+
+void session_receive(Session& session, Packet& received, TimerWheel& wheel, nano_t now)
+{
+    if (received.type() == GET)
+    {
+        // The client only sends a GET mid-transfer once it has the whole file
+        if (packet_string(received) == SUCCESS_MSG)
+            session.state = SESSION_FINISHED;
+        return;
+    }
+    if (session.state != SESSION_SENDING)
+        return;
+
+    session.timeout_counter = 0;
+    Ack ack;
+    if (parse_ack(received, ack))
+        update_peer_window(session, ack);
+
+    size_t base = session.window_base;
+    if (session.mode == MODE_SELECTIVE_REPEAT)
+    {
+        session_receive_selective(session, received, ack, wheel, now);
+        count_reply(session, received, base);
+        return;
+    }
+
+    if (received.type() == ACK)
+    {
+        // The client names the next packet it expects, so an ACK covers
+        // everything before it even if earlier ACKs were lost
+        LOG(LOG_DEBUG, "ACKNOLEDGE: sequence %u\n\n", ack.sequence);
+        size_t index;
+        if (cumulative_index(session, ack.sequence, index))
+        {
+            acknowledge_through(session, index, wheel, now);
+        }
+        else if (ack.sequence == (session.window_base & session.sequence_mask)
+            && ++session.dupacks == session.dupack_threshold)
+        {
+            // The client keeps asking for the base, so it was most likely
+            // lost: go back now rather than waiting out the RTO
+            LOG(LOG_DEBUG, "FAST RETRANSMIT: sequence %u\n\n", session.window_base & session.sequence_mask);
+            session.current = session.window_base;
+            packet_lost(session);
+        }
+    }
+    else if (received.type() == NAK)
+    {
+        LOG(LOG_DEBUG, "DAMAGED DATA: sequence %u\n\n", ack.sequence);
+        session.current = session.window_base;
+        packet_lost(session);
+    }
+    count_reply(session, received, base);
+}
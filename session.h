@@ -0,0 +1,107 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <netinet/in.h>
+#include "util.h"
+#include "timers.h"
+#include "rtt.h"
+#include "congestion.h"
+#include "packetizer.h"
+#include "fec.h"
+#include "stats.h"
+#include "netio.h"
+#include "timer_wheel.h"
+
+using std::vector;
+
+#define SESSION_SENDING 0
+#define SESSION_CLOSING 1
+#define SESSION_FINISHED 2
+#define SESSION_FAILED 3
+
+// Duplicate ACKs that trigger a retransmission before the RTO expires. With
+// parity on, a group's worth more are allowed, as the client may yet rebuild
+// the packet.
+#define SESSION_DUPACK_THRESHOLD 3
+
+// The kinds of TimerEvent a session schedules
+#define SESSION_TIMER_RETRANSMIT 0
+#define SESSION_TIMER_DELAY 1
+#define SESSION_TIMER_CLOSE 2
+
+// Packets the gremlin delays are held in blocks of this many slots
+#define SESSION_DELAY_BLOCK 16
+
+/// Identifies a client by its IPv4 address and port, in network byte order.
+typedef std::pair<uint32_t, uint16_t> ClientKey;
+
+/// All of the sender state for one file transfer to one client, in either
+/// Go-Back-N or Selective Repeat mode. The packets in flight are bounded by
+/// both the congestion window and the window the client advertises. Sessions
+/// share the server socket and each gets to queue its sendable packets on
+/// every pass of the event loop, so that no client can hold up the others.
+/// Its deadlines live on the server's TimerWheel and come back to it through
+/// session_timer(). Parity packets, when the client asks for them, go out
+/// after each group of data packets is first sent, outside the window, and
+/// an INF packet goes out with every send of packet 0 if the client asked.
+struct Session
+{
+	struct sockaddr_in client_addr;
+	uint64_t owner;
+	uint32_t generation;
+	int state;
+	uint8_t version;
+	uint16_t payload_size;
+	uint8_t mode;
+	uint8_t checksum;
+	uint32_t sequence_mask;
+	size_t max_window;
+
+	Packetizer packets;
+	FecEncoder parity;
+	PacketSlots file_info;
+	vector<nano_t> sent;
+	vector<bool> acked;
+	vector<bool> retransmitted;
+	vector<bool> lost;
+	vector<size_t> resend;
+	bool timed_out;
+	RttEstimator rtt;
+	CongestionControl congestion;
+	size_t peer_window;
+	size_t recover;
+	size_t loss_scan;
+	size_t window_base;
+	size_t window_end;
+	size_t current;
+	size_t next_new;
+	int dupacks;
+	int dupack_threshold;
+	int timeout_counter;
+	SessionStats stats;
+
+	// Slot i is in block i / SESSION_DELAY_BLOCK; blocks are only added, so
+	// held packets never move
+	std::deque<PacketSlots> delay_blocks;
+	vector<size_t> delay_free;
+};
+
+typedef std::map<ClientKey, Session> SessionTable;
+
+ClientKey client_key(const struct sockaddr_in& addr);
+ClientKey owner_key(uint64_t owner);
+std::string client_string(const struct sockaddr_in& addr);
+
+bool session_start(Session& session, Request& request, uint8_t version, struct sockaddr_in client_addr,
+	int congestion, PacketCache& cache);
+size_t session_window(Session& session);
+bool session_pump(Session& session, SendBatch& batch, GremlinInfo& info, TimerWheel& wheel, nano_t now);
+void session_receive(Session& session, Packet& received, TimerWheel& wheel, nano_t now);
+void session_timer(Session& session, TimerEvent& event, SendBatch& batch, TimerWheel& wheel, nano_t now);
+
+#endif
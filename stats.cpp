@@ -0,0 +1,356 @@
+/// @file stats.cpp
+///
+/// Live counters and histograms for the server, and the Unix socket thread
+/// that reports them.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <thread>
+
+#include "stats.h"
+#include "session.h"
+
+ServerStats server_stats;
+
+// The quantiles every histogram is reported at
+static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char* QUANTILE_NAMES[] = { "p50", "p90", "p99", "p999" };
+#define QUANTILE_COUNT (sizeof(QUANTILES) / sizeof(QUANTILES[0]))
+
+static size_t bucket_of(uint64_t value)
+{
+	if (value < HISTOGRAM_SUB_COUNT)
+		return value;
+	int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) + (value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+// The highest value that lands in bucket
+static uint64_t bucket_top(size_t bucket)
+{
+	if (bucket < HISTOGRAM_SUB_COUNT)
+		return bucket;
+	int shift = (int)(bucket >> HISTOGRAM_SUB_BITS) - 1;
+	uint64_t bottom = (uint64_t)((bucket & (HISTOGRAM_SUB_COUNT - 1)) + HISTOGRAM_SUB_COUNT) << shift;
+	return bottom + (((uint64_t)1 << shift) - 1);
+}
+
+Histogram::Histogram() : _max(0)
+{
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		_counts[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::record(uint64_t value)
+{
+	_counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+	uint64_t max = _max.load(std::memory_order_relaxed);
+	while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+		;
+}
+
+uint64_t Histogram::summarize(const double* quantiles, uint64_t* values, size_t count, uint64_t& max) const
+{
+	// Recording carries on meanwhile, so the counts are copied once and
+	// everything is worked out from the copy
+	static thread_local uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		counts[i] = _counts[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+	max = _max.load(std::memory_order_relaxed);
+
+	for (size_t q = 0; q < count; ++q)
+	{
+		values[q] = 0;
+		uint64_t rank = (uint64_t)(quantiles[q] * total + 0.5);
+		if (rank == 0)
+			rank = 1;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < HISTOGRAM_BUCKETS && total > 0; ++i)
+		{
+			seen += counts[i];
+			if (seen >= rank)
+			{
+				values[q] = bucket_top(i) < max ? bucket_top(i) : max;
+				break;
+			}
+		}
+	}
+	return total;
+}
+
+SessionStats::SessionStats()
+{
+	std::lock_guard<std::mutex> guard(server_stats._lock);
+	server_stats._sessions.insert(this);
+}
+
+SessionStats::~SessionStats()
+{
+	std::lock_guard<std::mutex> guard(server_stats._lock);
+	server_stats.retire(*this);
+	server_stats._sessions.erase(this);
+}
+
+void SessionStats::start(const struct sockaddr_in& client, const std::string& file)
+{
+	std::lock_guard<std::mutex> guard(server_stats._lock);
+	server_stats.retire(*this);
+	server_stats._started++;
+	_client = client_string(client);
+	_file = file;
+}
+
+ServerStats::ServerStats()
+	: _sent(0), _retransmitted(0), _timeouts(0), _naks(0), _dupacks(0), _bytes_delivered(0), _started(0),
+	  finished(0), failed(0)
+{
+}
+
+// Moves a session's counts into the totals. Called with the lock held.
+void ServerStats::retire(SessionStats& session)
+{
+	_sent += session.sent.get();
+	_retransmitted += session.retransmitted.get();
+	_timeouts += session.timeouts.get();
+	_naks += session.naks.get();
+	_dupacks += session.dupacks.get();
+	_bytes_delivered += session.bytes_delivered.get();
+	session.sent.set(0);
+	session.retransmitted.set(0);
+	session.timeouts.set(0);
+	session.naks.set(0);
+	session.dupacks.set(0);
+	session.bytes_delivered.set(0);
+	session.srtt_nsec.set(0);
+	session.in_flight.set(0);
+}
+
+// Adds printf-style text to out
+static void append(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static void append(std::string& out, const char* format, ...)
+{
+	char line[512];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length > 0)
+		out.append(line, (size_t)length < sizeof(line) ? length : sizeof(line) - 1);
+}
+
+// A string as a JSON string literal
+static std::string quoted(const std::string& text)
+{
+	std::string out = "\"";
+	for (size_t i = 0; i < text.size(); ++i)
+	{
+		unsigned char c = text[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20)
+		{
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", c);
+			out += escape;
+		}
+		else
+		{
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+// Counters of the live sessions and the finished ones, added up
+struct Totals
+{
+	uint64_t sent;
+	uint64_t retransmitted;
+	uint64_t timeouts;
+	uint64_t naks;
+	uint64_t dupacks;
+	uint64_t bytes_delivered;
+};
+
+static void add_session(Totals& totals, const SessionStats& session)
+{
+	totals.sent += session.sent.get();
+	totals.retransmitted += session.retransmitted.get();
+	totals.timeouts += session.timeouts.get();
+	totals.naks += session.naks.get();
+	totals.dupacks += session.dupacks.get();
+	totals.bytes_delivered += session.bytes_delivered.get();
+}
+
+static void histogram_text(std::string& out, const char* name, const Histogram& histogram, uint64_t scale)
+{
+	uint64_t values[QUANTILE_COUNT];
+	uint64_t max;
+	uint64_t count = histogram.summarize(QUANTILES, values, QUANTILE_COUNT, max);
+	append(out, "%s: count %llu", name, (unsigned long long)count);
+	for (size_t q = 0; q < QUANTILE_COUNT; ++q)
+		append(out, " %s %llu", QUANTILE_NAMES[q], (unsigned long long)(values[q] / scale));
+	append(out, " max %llu\n", (unsigned long long)(max / scale));
+}
+
+static void histogram_json(std::string& out, const char* name, const Histogram& histogram, uint64_t scale)
+{
+	uint64_t values[QUANTILE_COUNT];
+	uint64_t max;
+	uint64_t count = histogram.summarize(QUANTILES, values, QUANTILE_COUNT, max);
+	append(out, "\"%s\":{\"count\":%llu", name, (unsigned long long)count);
+	for (size_t q = 0; q < QUANTILE_COUNT; ++q)
+		append(out, ",\"%s\":%llu", QUANTILE_NAMES[q], (unsigned long long)(values[q] / scale));
+	append(out, ",\"max\":%llu}", (unsigned long long)(max / scale));
+}
+
+std::string ServerStats::text()
+{
+	Totals totals = { _sent, _retransmitted, _timeouts, _naks, _dupacks, _bytes_delivered };
+	std::string sessions;
+	for (std::set<SessionStats*>::iterator it = _sessions.begin(); it != _sessions.end(); ++it)
+	{
+		const SessionStats& session = **it;
+		add_session(totals, session);
+		if (session._client.empty())
+			continue;
+		sessions += "session " + session._client + " " + session._file;
+		append(sessions, ": sent %llu retransmitted %llu timeouts %llu naks %llu dupacks %llu "
+			"bytes_delivered %llu srtt_usec %llu in_flight %llu\n", (unsigned long long)session.sent.get(), (unsigned long long)session.retransmitted.get(),
+			(unsigned long long)session.timeouts.get(), (unsigned long long)session.naks.get(),
+			(unsigned long long)session.dupacks.get(), (unsigned long long)session.bytes_delivered.get(),
+			(unsigned long long)session.srtt_nsec.get() / 1000, (unsigned long long)session.in_flight.get());
+	}
+
+	std::string out;
+	append(out, "sessions: live %zu started %llu finished %llu failed %llu\n", _sessions.size(),
+		(unsigned long long)_started, (unsigned long long)finished.load(std::memory_order_relaxed),
+		(unsigned long long)failed.load(std::memory_order_relaxed));
+	append(out, "packets: sent %llu retransmitted %llu timeouts %llu naks %llu dupacks %llu\n",
+		(unsigned long long)totals.sent, (unsigned long long)totals.retransmitted,
+		(unsigned long long)totals.timeouts, (unsigned long long)totals.naks, (unsigned long long)totals.dupacks);
+	append(out, "bytes_delivered: %llu\n", (unsigned long long)totals.bytes_delivered);
+	histogram_text(out, "rtt_usec", rtt, 1000);
+	histogram_text(out, "window_packets", window, 1);
+	return out + sessions;
+}
+
+std::string ServerStats::json()
+{
+	Totals totals = { _sent, _retransmitted, _timeouts, _naks, _dupacks, _bytes_delivered };
+	std::string sessions;
+	for (std::set<SessionStats*>::iterator it = _sessions.begin(); it != _sessions.end(); ++it)
+	{
+		const SessionStats& session = **it;
+		add_session(totals, session);
+		if (session._client.empty())
+			continue;
+		if (!sessions.empty())
+			sessions += ",";
+		sessions += "{\"client\":" + quoted(session._client) + ",\"file\":" + quoted(session._file);
+		append(sessions, ",\"sent\":%llu,\"retransmitted\":%llu,\"timeouts\":%llu,\"naks\":%llu,\"dupacks\":%llu,"
+			"\"bytes_delivered\":%llu,\"srtt_usec\":%llu,\"in_flight\":%llu}",
+			(unsigned long long)session.sent.get(), (unsigned long long)session.retransmitted.get(),
+			(unsigned long long)session.timeouts.get(), (unsigned long long)session.naks.get(),
+			(unsigned long long)session.dupacks.get(), (unsigned long long)session.bytes_delivered.get(),
+			(unsigned long long)session.srtt_nsec.get() / 1000, (unsigned long long)session.in_flight.get());
+	}
+
+	std::string out;
+	append(out, "{\"sessions\":{\"live\":%zu,\"started\":%llu,\"finished\":%llu,\"failed\":%llu},", _sessions.size(),
+		(unsigned long long)_started, (unsigned long long)finished.load(std::memory_order_relaxed),
+		(unsigned long long)failed.load(std::memory_order_relaxed));
+	append(out, "\"packets\":{\"sent\":%llu,\"retransmitted\":%llu,\"timeouts\":%llu,\"naks\":%llu,\"dupacks\":%llu},",
+		(unsigned long long)totals.sent, (unsigned long long)totals.retransmitted,
+		(unsigned long long)totals.timeouts, (unsigned long long)totals.naks, (unsigned long long)totals.dupacks);
+	append(out, "\"bytes_delivered\":%llu,", (unsigned long long)totals.bytes_delivered);
+	histogram_json(out, "rtt_usec", rtt, 1000);
+	out += ",";
+	histogram_json(out, "window_packets", window, 1);
+	return out + ",\"live\":[" + sessions + "]}\n";
+}
+
+std::string ServerStats::report(bool json)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return json ? this->json() : text();
+}
+
+// Answers one stats client
+static void answer(int connection)
+{
+	char request[16] = { 0 };
+	struct pollfd watch;
+	watch.fd = connection;
+	watch.events = POLLIN;
+	if (poll(&watch, 1, STATS_REQUEST_MSEC) == 1)
+	{
+		ssize_t length = recv(connection, request, sizeof(request) - 1, 0);
+		request[length > 0 ? length : 0] = '\0';
+	}
+	std::string reply = server_stats.report(strncmp(request, "json", 4) == 0);
+	for (size_t written = 0; written < reply.size();)
+	{
+		ssize_t length = send(connection, reply.data() + written, reply.size() - written, MSG_NOSIGNAL);
+		if (length <= 0)
+			break;
+		written += length;
+	}
+	close(connection);
+}
+
+static void serve_stats(int listener)
+{
+	while (true)
+	{
+		int connection = accept(listener, NULL, NULL);
+		if (connection == -1)
+		{
+			if (errno != EINTR)
+				perror("Error: Could not accept a stats connection");
+			continue;
+		}
+		answer(connection);
+	}
+}
+
+void ServerStats::serve(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Error: Stats socket path is too long\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	// A socket left behind by an earlier run would make bind() fail, but
+	// anything else at the path is not ours to remove
+	struct stat info;
+	if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(path);
+	if (listener == -1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listener, 8) == -1)
+	{
+		perror("Error: Could not open the stats socket");
+		exit(EXIT_FAILURE);
+	}
+	std::thread(serve_stats, listener).detach();
+}
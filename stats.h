@@ -0,0 +1,146 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <netinet/in.h>
+
+// Histogram buckets per power of two, as a power of two: 5 keeps every
+// recorded value within about 3% of the value reported for it
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+// How long a stats client has to send its request line
+#define STATS_REQUEST_MSEC 100
+
+/// A count only one thread adds to, which any thread may read. Adding is a
+/// relaxed load and store rather than a locked read-modify-write, so it
+/// costs the sender next to nothing.
+class StatCounter
+{
+private:
+	std::atomic<uint64_t> _value;
+
+public:
+	StatCounter() : _value(0) {}
+
+	void add(uint64_t count = 1)
+	{
+		_value.store(_value.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+	}
+	void set(uint64_t value) { _value.store(value, std::memory_order_relaxed); }
+	uint64_t get() const { return _value.load(std::memory_order_relaxed); }
+};
+
+/// A log-linear histogram in the style of HdrHistogram: values below
+/// HISTOGRAM_SUB_COUNT get a bucket each, and every power of two above that
+/// is split into HISTOGRAM_SUB_COUNT equal buckets, so the relative error is
+/// the same at any scale. Any thread may record, with relaxed atomics.
+class Histogram
+{
+private:
+	std::atomic<uint64_t> _counts[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> _max;
+
+	Histogram(const Histogram&);
+	Histogram& operator=(const Histogram&);
+
+public:
+	Histogram();
+
+	void record(uint64_t value);
+
+	/// Adds up the counts and summarizes them: the number of values, the
+	/// largest, and the value each of the given quantiles (0 to 1) falls at,
+	/// given as the highest value its bucket holds.
+	uint64_t summarize(const double* quantiles, uint64_t* values, size_t count, uint64_t& max) const;
+};
+
+/// What one transfer has done. A Session owns its SessionStats, which
+/// registers with the server's stats when it is made and, when it goes,
+/// adds its counts to the totals of finished transfers. Only the session's
+/// thread updates it.
+class SessionStats
+{
+private:
+	std::string _client;
+	std::string _file;
+
+	SessionStats(const SessionStats&);
+	SessionStats& operator=(const SessionStats&);
+
+	friend class ServerStats;
+
+public:
+	// Data packets sent, and how many of those sends were retransmissions
+	StatCounter sent;
+	StatCounter retransmitted;
+	// Retransmit timeouts, damaged packets the client reported, and ACKs
+	// that did not move the window
+	StatCounter timeouts;
+	StatCounter naks;
+	StatCounter dupacks;
+	// Payload bytes of the data packets the client has acknowledged
+	StatCounter bytes_delivered;
+	// The latest smoothed RTT, and packets in flight
+	StatCounter srtt_nsec;
+	StatCounter in_flight;
+
+	SessionStats();
+	~SessionStats();
+
+	/// Starts counting a new transfer, after adding up the one before it.
+	void start(const struct sockaddr_in& client, const std::string& file);
+};
+
+/// Counters for the whole server and the live transfers, served as text or
+/// JSON on a Unix socket.
+class ServerStats
+{
+private:
+	std::mutex _lock;
+	std::set<SessionStats*> _sessions;
+	// Sums of the counters of transfers that are gone or restarted
+	uint64_t _sent;
+	uint64_t _retransmitted;
+	uint64_t _timeouts;
+	uint64_t _naks;
+	uint64_t _dupacks;
+	uint64_t _bytes_delivered;
+	uint64_t _started;
+
+	void retire(SessionStats& session);
+	std::string text();
+	std::string json();
+
+	ServerStats(const ServerStats&);
+	ServerStats& operator=(const ServerStats&);
+
+	friend class SessionStats;
+
+public:
+	std::atomic<uint64_t> finished;
+	std::atomic<uint64_t> failed;
+	// Each RTT sample, in nanoseconds, and the packets in flight at each ACK
+	Histogram rtt;
+	Histogram window;
+
+	ServerStats();
+
+	/// Everything, as text, or as JSON if json is true.
+	std::string report(bool json);
+
+	/// Answers connections on a Unix socket at path from a thread of its
+	/// own. A client may send "json" to get JSON; anything else, or nothing,
+	/// gets text. Exits if the socket cannot be set up.
+	void serve(const char* path);
+};
+
+extern ServerStats server_stats;
+
+#endif
@@ -0,0 +1,79 @@
+/// @file timer_wheel.cpp
+///
+/// One wheel holds every deadline the server has: retransmissions, delayed
+/// packet releases and session close timers. The event loop reads the clock
+/// once a pass and fires whatever is due, instead of every session polling a
+/// clock per packet.
+
+#include "poller.h"
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+TimerWheel::TimerWheel() : _slots(TIMER_WHEEL_SLOTS), _tick(0), _count(0)
+{
+	_tick = now_nsec() / TIMER_WHEEL_TICK_NSEC;
+}
+
+void TimerWheel::schedule(const TimerEvent& event)
+{
+	// Round up so an event never fires before it is due, and never file one
+	// under a tick that has already been passed
+	uint64_t tick = (event.due + TIMER_WHEEL_TICK_NSEC - 1) / TIMER_WHEEL_TICK_NSEC;
+	if (tick <= _tick)
+		tick = _tick + 1;
+	_slots[tick & TIMER_WHEEL_MASK].push_back(event);
+	_count++;
+}
+
+// Moves the due events of a slot to fired, keeping the rest in place
+void TimerWheel::expire(size_t slot, nano_t now, std::vector<TimerEvent>& fired)
+{
+	std::vector<TimerEvent>& events = _slots[slot];
+	size_t kept = 0;
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		if (events[i].due <= now)
+			fired.push_back(events[i]);
+		else
+			events[kept++] = events[i];
+	}
+	_count -= events.size() - kept;
+	events.resize(kept);
+}
+
+void TimerWheel::advance(nano_t now, std::vector<TimerEvent>& fired)
+{
+	uint64_t target = now / TIMER_WHEEL_TICK_NSEC;
+	if (target <= _tick)
+		return;
+
+	if (_count == 0)
+	{
+		_tick = target;
+		return;
+	}
+
+	// After a long sleep visit each slot once rather than each tick
+	uint64_t first = _tick + 1;
+	if (target - _tick > TIMER_WHEEL_SLOTS)
+		first = target - TIMER_WHEEL_SLOTS + 1;
+	for (uint64_t tick = first; tick <= target && _count > 0; ++tick)
+		expire(tick & TIMER_WHEEL_MASK, now, fired);
+	_tick = target;
+}
+
+int64_t TimerWheel::next_deadline(nano_t now)
+{
+	if (_count == 0)
+		return POLL_FOREVER;
+
+	for (uint64_t tick = _tick + 1; tick <= _tick + TIMER_WHEEL_SLOTS; ++tick)
+	{
+		if (_slots[tick & TIMER_WHEEL_MASK].empty())
+			continue;
+		nano_t at = tick * TIMER_WHEEL_TICK_NSEC;
+		return at > now ? (int64_t)(at - now) : 1;
+	}
+	return POLL_FOREVER;
+}
@@ -0,0 +1,56 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "timers.h"
+
+#define TIMER_WHEEL_TICK_NSEC 250000
+// A power of two; a full turn of the wheel is 256 ms
+#define TIMER_WHEEL_SLOTS 1024
+
+/// Something to be done at a given time. owner and generation say whose
+/// event it is, so an event outliving its owner can be recognised and
+/// ignored; kind, index and stamp mean whatever the owner wants. Events are
+/// never cancelled: an owner that restarts a timer just schedules another
+/// and uses stamp to tell the stale one apart when it fires.
+struct TimerEvent
+{
+	nano_t due;
+	uint64_t owner;
+	uint32_t generation;
+	uint32_t kind;
+	size_t index;
+	nano_t stamp;
+};
+
+/// A hashed timing wheel. Scheduling is O(1), and advancing to the present
+/// costs O(1) per tick passed plus O(1) per event fired. An event further
+/// out than one turn waits in its slot, and is looked at again once a turn,
+/// until it is due.
+class TimerWheel
+{
+private:
+	std::vector<std::vector<TimerEvent> > _slots;
+	uint64_t _tick;
+	size_t _count;
+
+	void expire(size_t slot, nano_t now, std::vector<TimerEvent>& fired);
+
+public:
+	TimerWheel();
+
+	void schedule(const TimerEvent& event);
+
+	/// Appends every event due by now to fired, in no particular order.
+	void advance(nano_t now, std::vector<TimerEvent>& fired);
+
+	/// Nanoseconds until the first occupied tick, or POLL_FOREVER when the
+	/// wheel is empty. May be early, never late.
+	int64_t next_deadline(nano_t now);
+
+	size_t count() { return _count; }
+};
+
+#endif
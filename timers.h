@@ -2,13 +2,14 @@
 #define TIMERS_H
 
 #include <sys/time.h>
+#include <time.h>
 
 #define NANO_PER_SEC 1000000000
 #define NANO_PER_MILLI 1000000
 
 typedef unsigned long long nano_t;
 
-timespec diff(const timespec& start, const timespec& end)
+inline timespec diff(const timespec& start, const timespec& end)
 {
 	timespec temp;
 	if ((end.tv_nsec-start.tv_nsec) < 0)
@@ -24,13 +25,22 @@ timespec diff(const timespec& start, const timespec& end)
 	return temp;
 }
 
-nano_t nano_convert(const timespec& time)
+inline nano_t nano_convert(const timespec& time)
 {
 	nano_t result = 0;
 	result = ((nano_t) time.tv_sec * NANO_PER_SEC) + (nano_t) time.tv_nsec;
 	return result;
 }
 
+// Timers run off CLOCK_MONOTONIC so that wall clock steps (NTP, settimeofday)
+// can neither fire them early nor hold them back
+inline nano_t now_nsec()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return nano_convert(now);
+}
+
 struct Timer
 {
 private:
@@ -39,20 +49,52 @@ private:
 public:
 	void start()
 	{
-		clock_gettime(CLOCK_REALTIME, &_start);
+		clock_gettime(CLOCK_MONOTONIC, &_start);
 	}
 
-	bool timeout(unsigned int milli_timeout)
+	// Makes the next timeout() check fire straight away
+	void expire()
+	{
+		_start.tv_sec = 0;
+		_start.tv_nsec = 0;
+	}
+
+	nano_t elapsed()
 	{
 		timespec end;
-		clock_gettime(CLOCK_REALTIME, &end);
-		nano_t nano_timeout = (nano_t)milli_timeout * NANO_PER_MILLI;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		return nano_convert(diff(_start, end));
+	}
 
-		if (nano_convert(diff(_start, end)) > nano_timeout)
+	bool timeout(unsigned int milli_timeout)
+	{
+		return expired((nano_t)milli_timeout * NANO_PER_MILLI);
+	}
+
+	bool expired(nano_t nano_timeout)
+	{
+		if (elapsed() > nano_timeout)
 			return true;
 
 		return false;
 	}
+
+	// Nanoseconds left until timeout() fires, or 0 if it already has
+	nano_t remaining(unsigned int milli_timeout)
+	{
+		return remaining_nsec((nano_t)milli_timeout * NANO_PER_MILLI);
+	}
+
+	nano_t remaining_nsec(nano_t nano_timeout)
+	{
+		nano_t spent = elapsed();
+
+		if (spent > nano_timeout)
+			return 0;
+
+		// expired() needs strictly more than the full interval to pass
+		return nano_timeout - spent + 1;
+	}
 };
 
-#endif
\ No newline at end of file
+#endif
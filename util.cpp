@@ -1,52 +1,336 @@
 #include <string.h>
-#include <numeric>
+#include <new>
+#include "compress.h"
+#include "fec.h"
 #include "util.h"
 
 Packet::Packet()
 {
+	bzero(buffer, HEADER_SIZE);
+	set_version(PROTOCOL_VERSION);
+	set_checksum_type(CHECKSUM_CRC32C);
 }
 
-Packet::Packet(uint8_t sequence, uint8_t type)
+Packet::Packet(uint32_t sequence, uint8_t type)
 {
-	bzero(buffer, PACKET_SIZE);
+	bzero(buffer, HEADER_SIZE);
+	set_version(PROTOCOL_VERSION);
+	set_checksum_type(CHECKSUM_CRC32C);
+	seal(0, sequence, type);
+}
+
+Packet::Packet(char* segment, uint16_t length, uint32_t sequence, uint8_t type)
+{
+	bzero(buffer, HEADER_SIZE);
+	set_version(PROTOCOL_VERSION);
+	set_checksum_type(CHECKSUM_CRC32C);
+	memcpy(data(), segment, length);
+	seal(length, sequence, type);
+}
 
-	char* segment = (char*)(buffer + 6);
+void Packet::seal(uint16_t length, uint32_t sequence, uint8_t type)
+{
 	uint16_t* size = (uint16_t*)(buffer + 4);
-	uint16_t* chksum = (uint16_t*)(buffer + 2);
 	uint8_t* seq = (uint8_t*)(buffer + 1);
 	uint8_t* packet_type = (uint8_t*)(buffer + 0);
 
-	*size = 0;
-	*seq = sequence;
-	*packet_type = type;
-	*chksum = calc_checksum(segment, (uint16_t)*size);
+	*size = length;
+	*seq = (uint8_t)sequence;
+	if (version() >= 3)
+		*((uint32_t*)(buffer + LEGACY_HEADER_SIZE)) = sequence;
+	*packet_type = type | (version() << 4);
+
+	if (version() < 4)
+		*((uint16_t*)(buffer + 2)) = calc_checksum(*this);
+	else
+		*((uint32_t*)(buffer + EXTENDED_HEADER_SIZE)) = calc_checksum(*this);
 }
 
-Packet::Packet(char* segment, uint16_t length, uint8_t sequence, uint8_t type)
+bool Packet::verify()
+{
+	if (size() > MAX_PACKET_SIZE - header_size())
+		return false;
+	return checksum() == calc_checksum(*this);
+}
+
+void Packet::set_checksum_type(uint8_t algorithm)
+{
+	if (version() >= 4)
+		*((uint8_t*)(buffer + 2)) = algorithm;
+}
+
+void Packet::set_flags(uint8_t flags)
+{
+	if (version() >= 4)
+		*((uint8_t*)(buffer + 3)) = flags;
+}
+
+void Packet::set_version(uint8_t version)
 {
-	char* pack = (char*)(buffer + 6);
-	uint16_t* size = (uint16_t*)(buffer + 4);
-	uint16_t* chksum = (uint16_t*)(buffer + 2);
-	uint8_t* seq = (uint8_t*)(buffer + 1);
 	uint8_t* packet_type = (uint8_t*)(buffer + 0);
+	*packet_type = (*packet_type & TYPE_MASK) | (version << 4);
+}
 
-	bzero(buffer, PACKET_SIZE);
-	memcpy(pack, segment, length);
-	*size = length;
-	*seq = sequence;
-	*packet_type = type;
-	*chksum = calc_checksum(pack, (uint16_t)*size);
+void Packet::copy_from(Packet& other)
+{
+	memcpy(buffer, other.buffer, other.length());
 }
 
-int calc_checksum(char *msg, size_t len)
+void PacketSlots::assign(size_t count, size_t payload_size)
 {
-	return int(std::accumulate(msg, msg + len, (unsigned char) 0));
+	clear();
+
+	// Version 1 datagrams are padded out to PACKET_SIZE whatever their payload
+	_slot_size = HEADER_SIZE + payload_size;
+	if (_slot_size < PACKET_SIZE)
+		_slot_size = PACKET_SIZE;
+	_storage = (char*)calloc(count, _slot_size);
+	if (_storage == NULL)
+		throw std::bad_alloc();
+	_count = count;
+}
+
+void PacketSlots::clear()
+{
+	free(_storage);
+	_storage = NULL;
+	_count = 0;
+}
+
+// Request options are packed back to back after the filename
+#define REQUEST_OPTIONS_SIZE (sizeof(uint16_t) + 8 * sizeof(uint8_t) + sizeof(uint32_t) + 2 * sizeof(uint64_t))
+
+static void put_option(char*& out, const void* value, size_t size)
+{
+	memcpy(out, value, size);
+	out += size;
+}
+
+static void get_option(char*& in, char* end, void* value, size_t size)
+{
+	if (in + size > end)
+		return;
+	memcpy(value, in, size);
+	in += size;
 }
 
-int calc_checksum(Packet& packet)
+void request_defaults(Request& request)
+{
+	request.filename.clear();
+	request.payload_size = DEFAULT_PAYLOAD_SIZE;
+	request.mode = MODE_GO_BACK_N;
+	request.checksum = CHECKSUM_CRC32C;
+	request.stripes = 1;
+	request.stripe = 0;
+	request.stripe_block = 1;
+	request.offset = 0;
+	request.length = 0;
+	request.compression = COMPRESSION_NONE;
+	request.fec_group = 0;
+	request.fec_parity = 0;
+	request.info = 0;
+}
+
+void build_request(Packet& packet, const Request& request)
+{
+	char* segment = packet.data();
+	size_t name_length = request.filename.size();
+	if (name_length > MAX_PAYLOAD_SIZE - 1 - REQUEST_OPTIONS_SIZE)
+		name_length = MAX_PAYLOAD_SIZE - 1 - REQUEST_OPTIONS_SIZE;
+
+	memcpy(segment, request.filename.data(), name_length);
+	segment[name_length] = '\0';
+	char* options = segment + name_length + 1;
+	put_option(options, &request.payload_size, sizeof(request.payload_size));
+	put_option(options, &request.mode, sizeof(request.mode));
+	put_option(options, &request.checksum, sizeof(request.checksum));
+	put_option(options, &request.stripes, sizeof(request.stripes));
+	put_option(options, &request.stripe, sizeof(request.stripe));
+	put_option(options, &request.stripe_block, sizeof(request.stripe_block));
+	put_option(options, &request.offset, sizeof(request.offset));
+	put_option(options, &request.length, sizeof(request.length));
+	put_option(options, &request.compression, sizeof(request.compression));
+	put_option(options, &request.fec_group, sizeof(request.fec_group));
+	put_option(options, &request.fec_parity, sizeof(request.fec_parity));
+	put_option(options, &request.info, sizeof(request.info));
+
+	packet.seal(options - segment, 0, GET);
+}
+
+bool parse_request(Packet& packet, Request& request)
 {
 	char* data = packet.data();
-	return int(std::accumulate(data, data + (size_t)(packet.size()), (unsigned char) 0));
+	size_t size = packet.size();
+	size_t name_length = strnlen(data, size);
+
+	request_defaults(request);
+	request.filename.assign(data, name_length);
+
+	// Options only exist from version 2 on, after the filename's NUL
+	char* options = data + name_length + 1;
+	char* end = data + size;
+	if (packet.version() >= 2)
+	{
+		get_option(options, end, &request.payload_size, sizeof(request.payload_size));
+		get_option(options, end, &request.mode, sizeof(request.mode));
+		get_option(options, end, &request.checksum, sizeof(request.checksum));
+		get_option(options, end, &request.stripes, sizeof(request.stripes));
+		get_option(options, end, &request.stripe, sizeof(request.stripe));
+		get_option(options, end, &request.stripe_block, sizeof(request.stripe_block));
+		get_option(options, end, &request.offset, sizeof(request.offset));
+		get_option(options, end, &request.length, sizeof(request.length));
+		get_option(options, end, &request.compression, sizeof(request.compression));
+		get_option(options, end, &request.fec_group, sizeof(request.fec_group));
+		get_option(options, end, &request.fec_parity, sizeof(request.fec_parity));
+		get_option(options, end, &request.info, sizeof(request.info));
+	}
+
+	if (request.payload_size < MIN_PAYLOAD_SIZE)
+		request.payload_size = MIN_PAYLOAD_SIZE;
+	if (request.payload_size > MAX_PAYLOAD_SIZE)
+		request.payload_size = MAX_PAYLOAD_SIZE;
+	if (request.mode != MODE_SELECTIVE_REPEAT)
+		request.mode = MODE_GO_BACK_N;
+	if (request.checksum != CHECKSUM_INTERNET)
+		request.checksum = CHECKSUM_CRC32C;
+	// Only version 4 packets can say whether they are compressed
+	if (request.compression != COMPRESSION_LZ || packet.version() < 4)
+		request.compression = COMPRESSION_NONE;
+	// Parity packets carry a little more than a full payload
+	if (request.fec_group < 1 || request.fec_group > FEC_MAX_GROUP || request.fec_parity < 1
+		|| request.fec_parity > FEC_MAX_PARITY || packet.version() < 4
+		|| request.payload_size > MAX_PAYLOAD_SIZE - FEC_OVERHEAD)
+	{
+		request.fec_group = 0;
+		request.fec_parity = 0;
+	}
+	if (packet.version() < 4)
+		request.info = 0;
+	if (request.stripes < 1 || request.stripes > MAX_STRIPES || request.stripe >= request.stripes
+		|| request.stripe_block < 1)
+	{
+		request.stripes = 1;
+		request.stripe = 0;
+		request.stripe_block = 1;
+	}
+
+	return !request.filename.empty();
+}
+
+void build_info(Packet& packet, const FileInfo& info)
+{
+	char* options = packet.data();
+	put_option(options, &info.size, sizeof(info.size));
+	put_option(options, &info.mtime_sec, sizeof(info.mtime_sec));
+	put_option(options, &info.mtime_nsec, sizeof(info.mtime_nsec));
+	packet.seal(options - packet.data(), 0, INF);
+}
+
+bool parse_info(Packet& packet, FileInfo& info)
+{
+	if (packet.version() < 4 || packet.size() != sizeof(info.size) + sizeof(info.mtime_sec) + sizeof(info.mtime_nsec)
+		|| !packet.verify())
+		return false;
+
+	char* options = packet.data();
+	char* end = options + packet.size();
+	get_option(options, end, &info.size, sizeof(info.size));
+	get_option(options, end, &info.mtime_sec, sizeof(info.mtime_sec));
+	get_option(options, end, &info.mtime_nsec, sizeof(info.mtime_nsec));
+	return true;
+}
+
+bool same_file_info(const FileInfo& a, const FileInfo& b)
+{
+	return a.size == b.size && a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec;
+}
+
+uint64_t stripe_payload(const Request& request, uint64_t index)
+{
+	uint64_t block = index / request.stripe_block;
+	return (block * request.stripes + request.stripe) * request.stripe_block + index % request.stripe_block;
+}
+
+uint64_t stripe_payloads(const Request& request, uint64_t payloads)
+{
+	uint64_t block = request.stripe_block;
+	uint64_t blocks = (payloads + block - 1) / block;
+	if (blocks <= request.stripe)
+		return 0;
+
+	// Every block is whole except perhaps the file's last one
+	uint64_t mine = (blocks - request.stripe + request.stripes - 1) / request.stripes;
+	uint64_t result = mine * block;
+	if ((blocks - 1) % request.stripes == request.stripe)
+		result -= blocks * block - payloads;
+	return result;
+}
+
+void build_ack(Packet& packet, const Ack& ack, uint8_t type)
+{
+	char* options = packet.data();
+	put_option(options, &ack.window, sizeof(ack.window));
+	if (ack.sack_count > 0)
+	{
+		put_option(options, &ack.sack_count, sizeof(ack.sack_count));
+		put_option(options, ack.sack, ack.sack_count * sizeof(SackBlock));
+	}
+	packet.seal(options - packet.data(), ack.sequence, type);
+}
+
+bool parse_ack(Packet& packet, Ack& ack)
+{
+	ack.sequence = packet.sequence();
+	ack.window = window_limit(packet.version());
+	ack.sack_count = 0;
+
+	// A damaged advertisement is ignored rather than trusted
+	if (packet.version() < 2 || packet.size() > MAX_PAYLOAD_SIZE
+		|| !packet.verify())
+		return false;
+
+	char* options = packet.data();
+	char* end = options + packet.size();
+	get_option(options, end, &ack.window, sizeof(ack.window));
+
+	uint8_t count = 0;
+	get_option(options, end, &count, sizeof(count));
+	for (; ack.sack_count < count && ack.sack_count < ACK_MAX_SACK_BLOCKS; ++ack.sack_count)
+	{
+		if (options + sizeof(SackBlock) > end)
+			break;
+		get_option(options, end, &ack.sack[ack.sack_count], sizeof(SackBlock));
+	}
+	return true;
+}
+
+uint32_t sequence_mask(uint8_t version)
+{
+	return version < 3 ? SEQ_NUM - 1 : 0xFFFFFFFF;
+}
+
+size_t window_limit(uint8_t version)
+{
+	return version < 3 ? WINDOW_SIZE : MAX_WINDOW_SIZE;
+}
+
+int calc_checksum(char *msg, size_t len)
+{
+	return checksum(CHECKSUM_BYTE_SUM, msg, len);
+}
+
+uint32_t calc_checksum(Packet& packet)
+{
+	if (packet.version() < 4)
+		return calc_checksum(packet.data(), packet.size());
+
+	// The checksum covers the header too, with its own field taken as zero
+	uint32_t* field = (uint32_t*)(packet.buffer + EXTENDED_HEADER_SIZE);
+	uint32_t stored = *field;
+	*field = 0;
+	uint32_t result = checksum(packet.checksum_type(), packet.buffer, HEADER_SIZE + packet.size());
+	*field = stored;
+	return result;
 }
 
 // std::string packet_string(const Packet& packet)
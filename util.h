@@ -4,16 +4,54 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <string>
+#include "checksum.h"
 
 #define ACK 0
 #define NAK 1
 #define GET 2
 #define TRN 3
+// Parity over a group of TRN packets, sent only to clients that ask for it
+#define PAR 4
+// The size and modification time of the file being sent, for clients that
+// ask for it
+#define INF 5
+
+// The high nibble of the type byte carries the wire format version. Version
+// 1 clients leave it zero and always exchange full PACKET_SIZE datagrams;
+// from version 2 on datagrams are only as long as their header and payload.
+// Version 3 extends the header with a 32-bit sequence number, and version 4
+// with a 32-bit checksum over header and payload whose algorithm the sender
+// names in the byte at offset 2.
+#define PROTOCOL_VERSION 4
+#define TYPE_MASK 0x0F
+
+// Version 4 packets carry flags in the byte at offset 3. A compressed
+// packet's payload is the codec's output, and its size is the compressed
+// size; the checksum covers the bytes as sent.
+#define PACKET_FLAG_COMPRESSED 0x01
 
 #define PACKET_SIZE 512
-#define HEADER_SIZE 6
+#define LEGACY_HEADER_SIZE 6
+#define EXTENDED_HEADER_SIZE 10
+#define HEADER_SIZE 14
+#define MAX_PACKET_SIZE 65507
+#define DEFAULT_PAYLOAD_SIZE (PACKET_SIZE - LEGACY_HEADER_SIZE)
+#define MIN_PAYLOAD_SIZE 64
+#define MAX_PAYLOAD_SIZE (MAX_PACKET_SIZE - HEADER_SIZE)
+
+// Versions 1 and 2 count packets modulo SEQ_NUM in a single byte, which
+// bounds their window at WINDOW_SIZE. Version 3 sequence numbers wrap at
+// 2^32, so the window is only bounded by MAX_WINDOW_SIZE. The window
+// actually used is set per transfer by congestion and flow control.
 #define SEQ_NUM 32
 #define WINDOW_SIZE 16
+#define MAX_WINDOW_SIZE 8192
+
+// Retransmission schemes a client can ask for. Selective Repeat needs the
+// window to be at most half the sequence space.
+#define MODE_GO_BACK_N 0
+#define MODE_SELECTIVE_REPEAT 1
 
 #define SUCCESS_MSG "successfully completed"
 
@@ -27,21 +65,205 @@ struct GremlinInfo
 
 struct Packet
 {
-	char buffer[PACKET_SIZE];
+	char buffer[MAX_PACKET_SIZE];
 
-	uint8_t type() { return *((uint8_t*)(buffer + 0)); }
-	uint8_t sequence() { return *((uint8_t*)(buffer + 1)); }
-	uint16_t checksum() { return *((uint16_t*)(buffer + 2)); }
+	uint8_t type() { return *((uint8_t*)(buffer + 0)) & TYPE_MASK; }
+	uint8_t version() { return *((uint8_t*)(buffer + 0)) >> 4; }
 	uint16_t size() { return *((uint16_t*)(buffer + 4)); }
-	char* data() { return (char*)(buffer + 6); }
+	char* data() { return (char*)(buffer + header_size()); }
+
+	size_t header_size()
+	{
+		if (version() < 3)
+			return LEGACY_HEADER_SIZE;
+		return version() < 4 ? EXTENDED_HEADER_SIZE : HEADER_SIZE;
+	}
+
+	uint32_t checksum()
+	{
+		if (version() < 4)
+			return *((uint16_t*)(buffer + 2));
+		return *((uint32_t*)(buffer + EXTENDED_HEADER_SIZE));
+	}
+
+	uint8_t checksum_type()
+	{
+		return version() < 4 ? CHECKSUM_BYTE_SUM : *((uint8_t*)(buffer + 2));
+	}
+
+	uint8_t flags() { return version() < 4 ? 0 : *((uint8_t*)(buffer + 3)); }
+
+	// Version 3 keeps the full sequence number after the legacy header and
+	// only its low byte at offset 1
+	uint32_t sequence()
+	{
+		if (version() < 3)
+			return *((uint8_t*)(buffer + 1));
+		return *((uint32_t*)(buffer + LEGACY_HEADER_SIZE));
+	}
+
+	// Bytes that go on the wire: a version 1 peer expects the padded size
+	size_t length() { return version() < 2 ? PACKET_SIZE : header_size() + size(); }
 
 	Packet();
-	Packet(uint8_t sequence, uint8_t type);
-	Packet(char* segment, uint16_t length, uint8_t sequence, uint8_t type);
+	Packet(uint32_t sequence, uint8_t type);
+	Packet(char* segment, uint16_t length, uint32_t sequence, uint8_t type);
+
+	// Fills in the header for a payload already written to data(), in the
+	// version and with the checksum the packet is already stamped with
+	void seal(uint16_t length, uint32_t sequence, uint8_t type);
+
+	// True if the checksum matches the packet's contents
+	bool verify();
+
+	// Sets the wire format version. The payload offset depends on it, so it
+	// must be set before the payload is written.
+	void set_version(uint8_t version);
+
+	// Picks the checksum algorithm seal() uses. Only version 4 packets have a
+	// choice; older ones always use the byte sum.
+	void set_checksum_type(uint8_t algorithm);
+
+	// Sets the flags byte, which seal() covers but leaves alone. Older
+	// versions have no flags.
+	void set_flags(uint8_t flags);
+
+	// Copies just the bytes in use, not the whole buffer
+	void copy_from(Packet& other);
 };
 
+/// Packet slots that are each only big enough for one header and payload of
+/// a given size, so a large window of small datagrams does not cost a full
+/// MAX_PACKET_SIZE buffer per packet. Only the bytes up to a slot's size may
+/// be touched through the Packet it returns. The storage is zeroed lazily by
+/// the kernel, so slots that are never used cost no memory; a slot's version
+/// must be set before anything else is written to it.
+class PacketSlots
+{
+private:
+	char* _storage;
+	size_t _slot_size;
+	size_t _count;
+
+	PacketSlots(const PacketSlots&);
+	PacketSlots& operator=(const PacketSlots&);
+
+public:
+	PacketSlots() : _storage(NULL), _slot_size(0), _count(0) {}
+	~PacketSlots() { clear(); }
+
+	/// Makes count slots for payloads of up to payload_size bytes.
+	void assign(size_t count, size_t payload_size);
+	void clear();
+
+	size_t size() { return _count; }
+	size_t bytes() { return _count * _slot_size; }
+	Packet& operator[](size_t index) { return *(Packet*)(_storage + index * _slot_size); }
+};
+
+// A file may be fetched as up to MAX_STRIPES parallel transfers
+#define MAX_STRIPES 8
+
+/// A client's GET request. The payload holds the filename, a NUL, and then
+/// the transfer options; options an older client leaves off keep their
+/// defaults.
+///
+/// A striped request asks for one of stripes parallel transfers of the
+/// file. The file's payloads are dealt out in blocks of stripe_block
+/// payloads, block n going to stripe n % stripes, so each transfer covers
+/// its own byte ranges without either side knowing the file size up front.
+/// An unstriped request is stripe 0 of 1.
+///
+/// A ranged request only asks for the length bytes from offset on, or
+/// everything from offset on when length is zero; striping then splits that
+/// range. Packet 0 of a ranged transfer carries the byte at offset.
+///
+/// A version 4 client may ask for payloads compressed with a codec from
+/// compress.h. The server still sends a packet raw when compressing does not
+/// make it smaller, so the client goes by each packet's flags. It may also
+/// ask for fec_parity PAR packets after every fec_group data packets, from
+/// which it can rebuild that many lost ones; see fec.h. And it may ask for
+/// an INF packet describing the file; see FileInfo.
+struct Request
+{
+	std::string filename;
+	uint16_t payload_size;
+	uint8_t mode;
+	uint8_t checksum;
+	uint8_t stripes;
+	uint8_t stripe;
+	uint32_t stripe_block;
+	uint64_t offset;
+	uint64_t length;
+	uint8_t compression;
+	uint8_t fec_group;
+	uint8_t fec_parity;
+	uint8_t info;
+};
+
+void request_defaults(Request& request);
+void build_request(Packet& packet, const Request& request);
+bool parse_request(Packet& packet, Request& request);
+
+/// Which file a transfer comes from: its size and modification time when
+/// the server opened it. A version 4 server sends one as an INF packet, with
+/// the sequence number 0, alongside every send of packet 0 to a client that
+/// asks for it. As packet 0 is resent until it is acknowledged, a client
+/// that holds off acknowledging until it has the INF packet always gets one.
+/// A client keeping a checkpoint records it, so it only ever resumes a
+/// transfer of the same file.
+struct FileInfo
+{
+	uint64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+};
+
+void build_info(Packet& packet, const FileInfo& info);
+bool parse_info(Packet& packet, FileInfo& info);
+bool same_file_info(const FileInfo& a, const FileInfo& b);
+
+/// The position in the whole file, counted in payloads, of the payload a
+/// striped transfer sends as its packet index.
+uint64_t stripe_payload(const Request& request, uint64_t index);
+
+/// Payloads a striped transfer of a file of payloads payloads carries, not
+/// counting its empty final packet.
+uint64_t stripe_payloads(const Request& request, uint64_t payloads);
+
+/// A run of packets [start, end) that a receiver holds beyond its cumulative
+/// acknowledgement.
+struct SackBlock
+{
+	uint32_t start;
+	uint32_t end;
+};
+
+#define ACK_MAX_SACK_BLOCKS 8
+
+/// An ACK or NAK. From version 2 on the payload advertises the receive
+/// window: how many packets the receiver has room for in flight. An older
+/// client's empty payload leaves the window at its version's limit.
+///
+/// A version 3 ACK is cumulative, naming the first packet the receiver is
+/// still missing, and may be followed by SACK blocks for the packets it
+/// holds out of order past that point.
+struct Ack
+{
+	uint32_t sequence;
+	uint16_t window;
+	uint8_t sack_count;
+	SackBlock sack[ACK_MAX_SACK_BLOCKS];
+};
+
+void build_ack(Packet& packet, const Ack& ack, uint8_t type);
+bool parse_ack(Packet& packet, Ack& ack);
+
+uint32_t sequence_mask(uint8_t version);
+size_t window_limit(uint8_t version);
+
 int calc_checksum(char *msg, size_t len);
-int calc_checksum(Packet& packet);
+uint32_t calc_checksum(Packet& packet);
 
 // std::string packet_string(const Packet& packet);
 // std::string packet_string(const Packet& packet, size_t size);
@@ -0,0 +1,311 @@
+/// @file writer.cpp
+///
+/// The client's file output. The receive loop only ever copies a payload
+/// into memory; opening blocks, writing and syncing happen on the writer
+/// thread.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "writer.h"
+
+FileWriter::FileWriter()
+	: _fd(-1), _end(0), _size(0), _reserved(0), _failed(false), _durable(0), _unsynced(0), _stopping(false),
+	  _identified(false)
+{
+}
+
+FileWriter::~FileWriter()
+{
+	if (_fd != -1)
+		finish();
+	for (size_t i = 0; i < _chunks.size(); ++i)
+		free(_chunks[i].data);
+}
+
+off_t FileWriter::resume_point(const std::string& filename, FileInfo& info)
+{
+	std::string path = filename + WRITER_CHECKPOINT_SUFFIX;
+	FILE* file = fopen(path.c_str(), "r");
+	if (file == NULL)
+		return 0;
+
+	// A checkpoint that does not say which file it is for cannot be trusted
+	long long durable = 0;
+	unsigned long long size = 0;
+	long long mtime_sec = 0;
+	unsigned mtime_nsec = 0;
+	if (fscanf(file, "%lld %llu %lld %u", &durable, &size, &mtime_sec, &mtime_nsec) != 4 || durable < 0)
+		durable = 0;
+	fclose(file);
+	info.size = size;
+	info.mtime_sec = mtime_sec;
+	info.mtime_nsec = mtime_nsec;
+	return (off_t)durable;
+}
+
+bool FileWriter::identify(const FileInfo& info)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_identified)
+		return same_file_info(info, _info);
+	_info = info;
+	_identified = true;
+	return true;
+}
+
+bool FileWriter::open(const std::string& filename, off_t start, bool range)
+{
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+	if (start == 0 && !range)
+		flags |= O_TRUNC;
+	_fd = ::open(filename.c_str(), flags, 0644);
+	if (_fd == -1)
+		return false;
+	struct stat info;
+	if (fstat(_fd, &info) == -1)
+	{
+		::close(_fd);
+		_fd = -1;
+		return false;
+	}
+
+	_chunks.resize(WRITER_CHUNKS);
+	for (size_t i = 0; i < _chunks.size(); ++i)
+	{
+		if (posix_memalign((void**)&_chunks[i].data, WRITER_ALIGNMENT, WRITER_CHUNK_SIZE) != 0)
+		{
+			_chunks.resize(i);
+			::close(_fd);
+			_fd = -1;
+			return false;
+		}
+		_free.push_back(&_chunks[i]);
+	}
+
+	_main = Stream();
+	_main.offset = start;
+	_end = start;
+	_size = range ? info.st_size : 0;
+	_reserved = start > info.st_size ? start : info.st_size;
+	_checkpoint = range ? "" : filename + WRITER_CHECKPOINT_SUFFIX;
+	_written.clear();
+	if (start > 0 && !range)
+		_written[0] = start;
+	_durable = range ? 0 : start;
+	_unsynced = 0;
+	_checkpointed.start();
+	_failed = false;
+	_stopping = false;
+	_identified = false;
+	_thread = std::thread(&FileWriter::run, this);
+	return true;
+}
+
+// Hands the chunk a stream is filling to the writer thread
+void FileWriter::submit(Stream& stream)
+{
+	if (stream.filling == NULL || stream.filling->length == 0)
+		return;
+
+	std::lock_guard<std::mutex> guard(_lock);
+	off_t end = stream.filling->offset + stream.filling->length;
+	if (end > _end)
+		_end = end;
+	_queued.push_back(stream.filling);
+	stream.filling = NULL;
+	_changed.notify_all();
+}
+
+void FileWriter::seek(Stream& stream, off_t offset)
+{
+	if (stream.offset == offset)
+		return;
+	submit(stream);
+	stream.offset = offset;
+}
+
+bool FileWriter::append(Stream& stream, const char* data, size_t length)
+{
+	while (length > 0)
+	{
+		if (stream.filling == NULL)
+		{
+			std::unique_lock<std::mutex> guard(_lock);
+			while (_free.empty() && !_failed)
+				_changed.wait(guard);
+			if (_failed)
+				return false;
+			stream.filling = _free.back();
+			_free.pop_back();
+			stream.filling->length = 0;
+			stream.filling->offset = stream.offset;
+		}
+
+		size_t amount = WRITER_CHUNK_SIZE - stream.filling->length;
+		if (amount > length)
+			amount = length;
+		memcpy(stream.filling->data + stream.filling->length, data, amount);
+		stream.filling->length += amount;
+		stream.offset += amount;
+		data += amount;
+		length -= amount;
+
+		if (stream.filling->length == WRITER_CHUNK_SIZE)
+			submit(stream);
+	}
+	return !_failed;
+}
+
+// Adds [start, end) to the written extents, merging it with any it touches
+void FileWriter::record(off_t start, off_t end)
+{
+	std::map<off_t, off_t>::iterator next = _written.upper_bound(start);
+	if (next != _written.begin())
+	{
+		std::map<off_t, off_t>::iterator previous = next;
+		--previous;
+		if (previous->second >= start)
+		{
+			start = previous->first;
+			if (previous->second > end)
+				end = previous->second;
+			_written.erase(previous);
+		}
+	}
+	while (next != _written.end() && next->first <= end)
+	{
+		if (next->second > end)
+			end = next->second;
+		_written.erase(next++);
+	}
+	_written[start] = end;
+}
+
+// Syncs the file and records how much of it is complete from the start.
+// The checkpoint itself is best effort; a failed sync fails the file.
+bool FileWriter::checkpoint()
+{
+	_unsynced = 0;
+	_checkpointed.start();
+	off_t complete = 0;
+	if (!_written.empty() && _written.begin()->first == 0)
+		complete = _written.begin()->second;
+	if (complete <= _durable)
+		return true;
+
+	if (fdatasync(_fd) == -1)
+		return false;
+	_durable = complete;
+	FileInfo info;
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (_checkpoint.empty() || !_identified)
+			return true;
+		info = _info;
+	}
+
+	// Replace the checkpoint whole so a crash never leaves half of one
+	std::string temporary = _checkpoint + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "w");
+	if (file == NULL)
+		return true;
+	bool written = fprintf(file, "%lld %llu %lld %u\n", (long long)complete, (unsigned long long)info.size,
+		(long long)info.mtime_sec, (unsigned)info.mtime_nsec) > 0;
+	if (fclose(file) != 0 || !written || rename(temporary.c_str(), _checkpoint.c_str()) == -1)
+		unlink(temporary.c_str());
+	return true;
+}
+
+void FileWriter::run()
+{
+	std::unique_lock<std::mutex> guard(_lock);
+	while (true)
+	{
+		while (_queued.empty() && !_stopping)
+			_changed.wait(guard);
+		if (_queued.empty())
+			return;
+
+		Chunk* chunk = _queued.front();
+		_queued.pop_front();
+		bool failed = _failed;
+		guard.unlock();
+
+		if (!failed)
+		{
+			off_t end = chunk->offset + chunk->length;
+			if (end > _reserved)
+			{
+				// Best effort: not every filesystem can reserve space
+				if (fallocate(_fd, FALLOC_FL_KEEP_SIZE, _reserved, end - _reserved + WRITER_PREALLOCATE) == 0)
+					_reserved = end + WRITER_PREALLOCATE;
+				else
+					_reserved = end;
+			}
+
+			size_t written = 0;
+			while (written < chunk->length && !failed)
+			{
+				ssize_t result = pwrite(_fd, chunk->data + written, chunk->length - written, chunk->offset + written);
+				if (result < 0 && errno == EINTR)
+					continue;
+				if (result <= 0)
+					failed = true;
+				else
+					written += result;
+			}
+
+			if (!failed)
+			{
+				record(chunk->offset, end);
+				_unsynced += chunk->length;
+				if ((_unsynced >= WRITER_CHECKPOINT_BYTES || _checkpointed.timeout(WRITER_CHECKPOINT_MSEC))
+					&& !checkpoint())
+					failed = true;
+			}
+		}
+
+		guard.lock();
+		if (failed)
+			_failed = true;
+		_free.push_back(chunk);
+		_changed.notify_all();
+	}
+}
+
+bool FileWriter::finish()
+{
+	if (_fd == -1)
+		return false;
+
+	submit(_main);
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_stopping = true;
+		_changed.notify_all();
+	}
+	_thread.join();
+
+	// Truncating to the size already there hands back the space reserved
+	// past the end of the file. A range never cuts off what follows it.
+	bool ok = !_failed;
+	off_t size = _end > _size ? _end : _size;
+	if (ok && _reserved > size && ftruncate(_fd, size) == -1)
+		ok = false;
+	if (ok && fdatasync(_fd) == -1)
+		ok = false;
+	if (::close(_fd) == -1)
+		ok = false;
+	_fd = -1;
+
+	// A finished file needs no checkpoint; a failed one keeps its last one
+	if (ok && !_checkpoint.empty())
+		unlink(_checkpoint.c_str());
+	return ok;
+}
@@ -0,0 +1,139 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "timers.h"
+#include "util.h"
+
+// Payloads are gathered into chunks of this size, each written with one
+// pwrite
+#define WRITER_CHUNK_SIZE (1024 * 1024)
+// Chunks filling or queued before append() has to wait for the disk
+#define WRITER_CHUNKS 16
+// Disk space is reserved this far ahead of the data written
+#define WRITER_PREALLOCATE (64 * 1024 * 1024)
+#define WRITER_ALIGNMENT 4096
+// The file is synced and its checkpoint updated after this many bytes, or
+// once this long has passed since the last checkpoint with more written
+#define WRITER_CHECKPOINT_BYTES (16 * WRITER_CHUNK_SIZE)
+#define WRITER_CHECKPOINT_MSEC 1000
+#define WRITER_CHECKPOINT_SUFFIX ".part"
+
+/// Writes a file that arrives in order, without making the receive loop wait
+/// on the disk. Payloads are copied into large chunks that a background
+/// thread writes out while the next chunk fills, and the file's blocks are
+/// reserved with fallocate ahead of the writes. The size is never known up
+/// front, so space is reserved without changing the file size.
+///
+/// A file that arrives as several ranges at once is written through one
+/// Stream per range. Each stream may be appended to from its own thread.
+///
+/// While a whole file is being written, a checkpoint file next to it records
+/// how far from the start it is known to be complete and on disk, so an
+/// interrupted transfer can carry on from there. It also records which file
+/// on the server the bytes came from, and is only written once that is
+/// known, so a transfer is never resumed from a different file. It is
+/// removed once the file is finished. A range written into a file keeps no
+/// checkpoint, as the bytes before it were never fetched.
+class FileWriter
+{
+private:
+	struct Chunk
+	{
+		char* data;
+		size_t length;
+		off_t offset;
+	};
+
+public:
+	/// Where the next append to a stream goes, and the chunk it is filling.
+	struct Stream
+	{
+		Chunk* filling;
+		off_t offset;
+
+		Stream() : filling(NULL), offset(0) {}
+	};
+
+private:
+	int _fd;
+	std::vector<Chunk> _chunks;
+	Stream _main;
+	off_t _end;
+	off_t _size;
+	off_t _reserved;
+	// Set by the writer thread under the lock, but read by append() without it
+	std::atomic<bool> _failed;
+
+	// Only touched by the writer thread: the extents written so far, merged,
+	// and how much of the file the checkpoint vouches for
+	std::string _checkpoint;
+	std::map<off_t, off_t> _written;
+	off_t _durable;
+	off_t _unsynced;
+	Timer _checkpointed;
+
+	std::mutex _lock;
+	std::condition_variable _changed;
+	std::deque<Chunk*> _queued;
+	std::vector<Chunk*> _free;
+	bool _stopping;
+	// Which file the bytes come from, once it is known
+	FileInfo _info;
+	bool _identified;
+	std::thread _thread;
+
+	FileWriter(const FileWriter&);
+	FileWriter& operator=(const FileWriter&);
+
+	void run();
+	void submit(Stream& stream);
+	void record(off_t start, off_t end);
+	bool checkpoint();
+
+public:
+	FileWriter();
+	~FileWriter();
+
+	/// Creates or truncates the file and starts the writer thread. Returns
+	/// false if the file could not be opened. Given a start offset, the file
+	/// is kept and writing begins there. For a resume, the first start bytes
+	/// are taken as already written; for a range, the rest of the file is
+	/// left as it was and never made shorter.
+	bool open(const std::string& filename, off_t start = 0, bool range = false);
+
+	/// How much of the file an earlier, interrupted writer left complete, or
+	/// zero if there is no checkpoint for it, and which file that came from.
+	static off_t resume_point(const std::string& filename, FileInfo& info);
+
+	/// Says which file the bytes come from. The first call sets it; any
+	/// later one, from another stream or after a resume, must name the same
+	/// file, or false is returned.
+	bool identify(const FileInfo& info);
+
+	/// Appends length bytes. Returns false once any write has failed.
+	bool append(const char* data, size_t length) { return append(_main, data, length); }
+	bool append(Stream& stream, const char* data, size_t length);
+
+	/// Moves the stream to another offset in the file.
+	void seek(Stream& stream, off_t offset);
+
+	/// Hands what a stream has gathered to the writer thread. A stream must
+	/// be flushed before finish().
+	void flush(Stream& stream) { submit(stream); }
+
+	/// Writes out everything appended, waits for it to reach the disk and
+	/// closes the file. Returns false if anything went wrong on the way.
+	bool finish();
+};
+
+#endif